@@ -0,0 +1,56 @@
+#!/bin/sh
+# End-to-end checks of myindex against a temporary database, inspected
+# with xapian-delve (from xapian-tools).
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+# The number of documents in shard $1 indexed by term $2.
+termfreq() {
+  xapian-delve -t "$2" "$1" 2>/dev/null | sed -n 's/.*termfreq \([0-9]*\).*/\1/p'
+}
+
+check() {
+  if [ "$2" != "$3" ]; then
+    echo "FAIL: $1: got '$2', expected '$3'"
+    failed=1
+  else
+    echo "ok: $1"
+  fi
+}
+
+message() {
+  printf 'From %s@example.org Mon Jan  4 10:00:00 2010\n' "$1"
+  printf 'From: %s@example.org\nSubject: message %s\nMessage-Id: <%s@example.org>\n' "$1" "$1" "$1"
+  printf 'Content-Type: text/plain\n\n'
+}
+
+# A delivery caught half written is indexed again, whole, once the rest
+# of it has been appended.
+mbox=$tmp/check-201001
+{ message one; printf 'the first body\n\n'; } > $mbox
+{ message two; printf 'the second body begins\n'; } >> $mbox
+./myindex --dbname "$tmp/listdb" $mbox > /dev/null
+check "half written message indexed" "$(termfreq $tmp/listdb-000 begins)" 1
+printf 'and then zebrafinch ends it\n\n' >> $mbox
+./myindex --dbname "$tmp/listdb" $mbox > /dev/null
+check "rest of the message indexed" "$(termfreq $tmp/listdb-000 zebrafinch)" 1
+check "no new document for it" "$(termfreq $tmp/listdb-000 XMcheck-201001)" 2
+
+# After a resume, a duplicate of a spam message from before the
+# checkpoint still takes no msgnum of its own, as in a full scan.
+mbox=$tmp/check-201002
+printf 'skip-spam-message-id: <spam@example.org>\n' > $mbox.spam
+{ message one; printf 'the first body\n\n'; message spam; printf 'spam\n\n'; } > $mbox
+{ message two; printf 'the second body\n\n'; } >> $mbox
+./myindex --dbname "$tmp/listdb" $mbox > /dev/null
+{ message spam; printf 'spam again\n\n'; message four; printf 'the fourth body\n\n'; } >> $mbox
+./myindex --dbname "$tmp/listdb" $mbox > /dev/null
+check "duplicate spam after resume skipped" "$(termfreq $tmp/listdb-000 Qcheck20100200003)" 1
+
+exit $failed
@@ -0,0 +1,225 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+# Generate a reproducible synthetic mbox corpus for benchmarking myindex.
+#
+# Copyright (C) 2026 The debian-indexer-xapian authors
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+"""usage: gencorpus.py [options] outdir
+
+Writes <outdir>/<list>-<yyyymm> mboxes, named as myindex expects.  The
+same options and seed always give byte-identical output.
+
+  --seed N          random seed (default 1)
+  --lists N         number of lists (default 4)
+  --months N        months per list (default 3)
+  --messages N      messages per mbox (default 500)
+  --mix KIND=W,...  relative weights of message kinds, from
+                    plain qp base64 html alternative digest rfc822
+                    (default plain=50,qp=10,base64=10,html=10,
+                    alternative=10,digest=5,rfc822=5)
+  --charsets C=W,...
+                    relative weights of body charsets, from
+                    us-ascii utf-8 iso-8859-1 iso-8859-15 koi8-r
+                    (default us-ascii=40,utf-8=30,iso-8859-1=20,koi8-r=10)
+"""
+
+import base64
+import io
+import os
+import quopri
+import random
+import sys
+
+KINDS = ['plain', 'qp', 'base64', 'html', 'alternative', 'digest', 'rfc822']
+
+# Words to make bodies from, per charset.  No line may start "From ".
+ASCII_WORDS = u"""the package debian release bug upload maintainer patch kernel
+build source binary archive mirror security update install config policy
+testing stable unstable sid buster team mailing list thanks please should
+would could error warning version library depends conflicts provides
+""".split()
+LATIN_WORDS = ASCII_WORDS + u"""résumé café naïve
+über größe straße façade señor
+""".split()
+CYRILLIC_WORDS = u"""пакет сборка
+ошибка ядро
+версия спасибо
+""".split() + ASCII_WORDS[:20]
+WORDS = {
+  'us-ascii': ASCII_WORDS,
+  'utf-8': LATIN_WORDS + CYRILLIC_WORDS,
+  'iso-8859-1': LATIN_WORDS,
+  'iso-8859-15': LATIN_WORDS,
+  'koi8-r': CYRILLIC_WORDS,
+}
+
+def parse_weights(spec, known):
+  weights = []
+  for item in spec.split(','):
+    name, weight = item.split('=')
+    if name not in known:
+      sys.exit("unknown kind or charset: %s" % name)
+    weights.append((name, float(weight)))
+  return weights
+
+def pick(rng, weights):
+  total = sum(w for n, w in weights)
+  x = rng.uniform(0, total)
+  for name, w in weights:
+    x -= w
+    if x <= 0:
+      return name
+  return weights[-1][0]
+
+def paragraph(rng, charset, quoted=False):
+  words = WORDS[charset]
+  lines = []
+  for i in range(rng.randint(2, 8)):
+    line = u' '.join(rng.choice(words) for j in range(rng.randint(6, 12)))
+    if quoted:
+      line = u'> ' + line
+    lines.append(line)
+  return u'\n'.join(lines)
+
+def text_body(rng, charset):
+  paras = []
+  if rng.random() < 0.3:
+    paras.append(u'Someone wrote:\n' + paragraph(rng, charset, True))
+  for i in range(rng.randint(1, 5)):
+    paras.append(paragraph(rng, charset))
+  return u'\n\n'.join(paras) + u'\n'
+
+def html_body(rng, charset):
+  out = [u'<html><head><style>p { margin: 0 }</style></head><body>']
+  for i in range(rng.randint(1, 5)):
+    out.append(u'<p>%s &amp; <b>%s</b></p>' % (paragraph(rng, charset),
+                                                rng.choice(WORDS[charset])))
+  out.append(u'</body></html>\n')
+  return u'\n'.join(out)
+
+def leaf(rng, charset, subtype, encoding):
+  if subtype == 'html':
+    text = html_body(rng, charset)
+  else:
+    text = text_body(rng, charset)
+  data = text.encode(charset)
+  if encoding == 'base64':
+    body = base64.encodestring(data) if hasattr(base64, 'encodestring') \
+      else base64.encodebytes(data)
+  elif encoding == 'quoted-printable':
+    body = quopri.encodestring(data)
+  else:
+    encoding = '8bit' if charset != 'us-ascii' else '7bit'
+    body = data
+  head = ('Content-Type: text/%s; charset=%s\n'
+          'Content-Transfer-Encoding: %s\n\n' % (subtype, charset, encoding))
+  return head.encode('ascii') + body
+
+class Corpus:
+  def __init__(self, rng, mix, charsets):
+    self.rng = rng
+    self.mix = mix
+    self.charsets = charsets
+    self.serial = 0
+
+  def headers(self, lst, year, month, subject):
+    self.serial += 1
+    rng = self.rng
+    user = 'user%d' % rng.randint(1, 200)
+    return ('From: %s <%s@example.org>\n'
+            'To: %s@lists.example.org\n'
+            'Subject: %s\n'
+            'Date: Mon, %02d %s %d %02d:%02d:%02d +0000\n'
+            'Message-Id: <%d.%d@bench.example.org>\n'
+            'MIME-Version: 1.0\n'
+            % (user.capitalize(), user, lst, subject,
+               rng.randint(1, 28),
+               ['Jan', 'Feb', 'Mar', 'Apr', 'May', 'Jun', 'Jul', 'Aug',
+                'Sep', 'Oct', 'Nov', 'Dec'][month - 1],
+               year, rng.randint(0, 23), rng.randint(0, 59),
+               rng.randint(0, 59), self.serial, rng.randint(0, 1 << 30)))
+
+  def body(self, kind, lst, year, month):
+    rng = self.rng
+    charset = pick(rng, self.charsets)
+    if kind == 'plain':
+      return leaf(rng, charset, 'plain', None)
+    if kind == 'qp':
+      return leaf(rng, charset, 'plain', 'quoted-printable')
+    if kind == 'base64':
+      return leaf(rng, charset, 'plain', 'base64')
+    if kind == 'html':
+      return leaf(rng, charset, 'html', rng.choice([None, 'quoted-printable']))
+    boundary = '=-bench-%d' % rng.randint(0, 1 << 30)
+    if kind == 'alternative':
+      parts = [leaf(rng, charset, 'plain', 'quoted-printable'),
+               leaf(rng, charset, 'html', 'quoted-printable')]
+      ctype = 'multipart/alternative'
+    elif kind == 'digest':
+      # Parts of a digest default to message/rfc822.
+      parts = [b'\n' + self.message(rng.choice(['plain', 'qp']),
+                                    lst, year, month)
+               for i in range(rng.randint(2, 6))]
+      ctype = 'multipart/digest'
+    else:
+      parts = [leaf(rng, charset, 'plain', None),
+               b'Content-Type: message/rfc822\n\n' +
+               self.message(rng.choice(['plain', 'html', 'alternative']),
+                            lst, year, month)]
+      ctype = 'multipart/mixed'
+    out = [('Content-Type: %s; boundary="%s"\n\n'
+            'This is a multi-part message in MIME format.\n'
+            % (ctype, boundary)).encode('ascii')]
+    for part in parts:
+      out.append(('\n--%s\n' % boundary).encode('ascii'))
+      out.append(part)
+    out.append(('\n--%s--\n' % boundary).encode('ascii'))
+    return b''.join(out)
+
+  def message(self, kind, lst, year, month):
+    subject = 'Re: %s %s' % (self.rng.choice(ASCII_WORDS),
+                             self.rng.choice(ASCII_WORDS))
+    return (self.headers(lst, year, month, subject).encode('ascii') +
+            self.body(kind, lst, year, month))
+
+def main(argv):
+  opts = {'--seed': '1', '--lists': '4', '--months': '3', '--messages': '500',
+          '--mix': 'plain=50,qp=10,base64=10,html=10,alternative=10,'
+                   'digest=5,rfc822=5',
+          '--charsets': 'us-ascii=40,utf-8=30,iso-8859-1=20,koi8-r=10'}
+  args = argv[1:]
+  while args and args[0] in opts:
+    if len(args) < 2:
+      sys.exit(__doc__)
+    opts[args[0]] = args[1]
+    args = args[2:]
+  if len(args) != 1:
+    sys.exit(__doc__)
+  outdir = args[0]
+
+  rng = random.Random(int(opts['--seed']))
+  corpus = Corpus(rng, parse_weights(opts['--mix'], KINDS),
+                  parse_weights(opts['--charsets'], WORDS))
+  if not os.path.isdir(outdir):
+    os.makedirs(outdir)
+  for l in range(int(opts['--lists'])):
+    lst = 'bench-list%d' % l
+    for m in range(int(opts['--months'])):
+      year, month = 2010 + m // 12, m % 12 + 1
+      fn = os.path.join(outdir, '%s-%04d%02d' % (lst, year, month))
+      f = io.open(fn, 'wb')
+      for i in range(int(opts['--messages'])):
+        msg = corpus.message(pick(rng, corpus.mix), lst, year, month)
+        f.write(('From user@example.org Mon Jan  1 00:00:00 %d\n'
+                 % year).encode('ascii'))
+        f.write(msg)
+        f.write(b'\n')
+      f.close()
+
+if __name__ == '__main__':
+  main(sys.argv)
@@ -0,0 +1,265 @@
+/* Microbenchmarks for the indexer's per-message work, run over a corpus
+   from gencorpus.py:
+
+     microbench [-n iterations] mbox...
+
+   Each benchmark goes over every message of every mbox, iterations
+   times, and reports the time per call and the throughput over the bytes
+   it was given.  tokenizer.cc is included rather than linked, to get at
+   its static transforms. */
+
+// Also brings in xapianglue.h, util.h and metrics.h.
+#include "../tokenizer.cc"
+
+#include "../mbox.h"
+#include <xapian.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <vector>
+
+struct sample {
+  std::string text;		// message body, as in the mbox
+  std::string html;		// its first <html>...</html>, if any
+  GMimeMessage *msg;
+};
+
+static std::vector<sample> samples;
+static int iterations = 5;
+
+static void report(const char *name, size_t calls, size_t bytes, long long ns)
+{
+  printf("%-22s %8lu calls %10.2f us/call %9.2f MB/s\n", name,
+	 (unsigned long)calls, calls ? ns / 1e3 / calls : 0.0,
+	 ns ? bytes / 1e6 / (ns / 1e9) : 0.0);
+}
+
+static void load(const char *fn, mbox & mb)
+{
+  if (! mbox_open(mb, fn)) {
+    perror(fn);
+    exit(1);
+  }
+  mbox_index(mb, 0);
+  for (size_t i = 0; i < mb.messages.size(); ++i) {
+    const mbox_message & m = mb.messages[i];
+    sample s;
+    s.text.assign(mb.map + m.start, m.end - m.start);
+    size_t b = s.text.find("<html>");
+    size_t e = s.text.find("</html>", b);
+    if (b != std::string::npos && e != std::string::npos)
+      s.html = s.text.substr(b, e + 7 - b);
+    s.msg = mbox_parse_message(mb, i);
+    if (s.msg != NULL)
+      samples.push_back(s);
+  }
+}
+
+static void bench_parse_article(void)
+{
+  size_t calls = 0, bytes = 0;
+  long long start = metrics_now();
+  for (int n = 0; n < iterations; ++n)
+    for (size_t i = 0; i < samples.size(); ++i) {
+      parse_article(samples[i].msg);
+      ++calls;
+      bytes += samples[i].text.size();
+    }
+  report("parse_article", calls, bytes, metrics_now() - start);
+}
+
+static void bench_parse_simple_article(void)
+{
+  size_t calls = 0, bytes = 0, simple = 0;
+  long long start = metrics_now();
+  for (int n = 0; n < iterations; ++n)
+    for (size_t i = 0; i < samples.size(); ++i) {
+      const std::string & t = samples[i].text;
+      if (parse_simple_article(t.data(), t.size()) != NULL)
+	++simple;
+      ++calls;
+      bytes += t.size();
+    }
+  report("parse_simple_article", calls, bytes, metrics_now() - start);
+  printf("%-22s %8lu of %lu calls took the fast path\n", "",
+	 (unsigned long)simple, (unsigned long)calls);
+}
+
+// The terms, wdfs and data of the document parsed from i.
+static std::string indexed_form(document *d, size_t i)
+{
+  std::string msgid("check@bench"), list("bench"), id;
+  Xapian::Document *xdoc = xapian_build_document(d, msgid, list, 2010, 1, i, id);
+  std::string out = xdoc->get_data();
+  for (Xapian::TermIterator t = xdoc->termlist_begin();
+       t != xdoc->termlist_end(); ++t) {
+    char wdf[16];
+    sprintf(wdf, ":%u\n", (unsigned)t.get_wdf());
+    out += *t + wdf;
+  }
+  delete xdoc;
+  return out;
+}
+
+/* parse_simple_article() must index a message just as parse_article()
+   does; report any in the corpus for which it doesn't. */
+static void check_parse_simple_article(void)
+{
+  size_t checked = 0, differ = 0;
+  for (size_t i = 0; i < samples.size(); ++i) {
+    const std::string & t = samples[i].text;
+    document *d = parse_simple_article(t.data(), t.size());
+    if (d == NULL)
+      continue;
+    std::string fast = indexed_form(d, i);
+    std::string full = indexed_form(parse_article(samples[i].msg), i);
+    ++checked;
+    if (fast != full) {
+      ++differ;
+      if (differ <= 5)
+	fprintf(stderr, "parse_simple_article differs on message %lu\n",
+		(unsigned long)i);
+    }
+  }
+  printf("%-22s %8lu messages checked, %lu differ\n", "parse_simple_article",
+	 (unsigned long)checked, (unsigned long)differ);
+}
+
+static void bench_transform_text_html(void)
+{
+  size_t calls = 0, bytes = 0;
+  long long ns = 0;
+  for (int n = 0; n < iterations; ++n)
+    for (size_t i = 0; i < samples.size(); ++i) {
+      if (samples[i].html.empty())
+	continue;
+      xapian_new_document();
+      tallied_length = 0;
+      doc_body_length = 0;
+      long long start = metrics_now();
+      transform_text_html(samples[i].html.c_str());
+      ns += metrics_now() - start;
+      ++calls;
+      bytes += samples[i].html.size();
+    }
+  report("transform_text_html", calls, bytes, ns);
+}
+
+static void bench_save_body_bits(void)
+{
+  size_t calls = 0, bytes = 0;
+  long long ns = 0;
+  for (int n = 0; n < iterations; ++n)
+    for (size_t i = 0; i < samples.size(); ++i) {
+      const std::string & t = samples[i].text;
+      doc_body_length = 0;
+      long long start = metrics_now();
+      save_body_bits(t.data(), 0, t.size());
+      ns += metrics_now() - start;
+      ++calls;
+      bytes += t.size();
+    }
+  report("save_body_bits", calls, bytes, ns);
+}
+
+static void bench_convert_to_utf8(void)
+{
+  size_t calls = 0, bytes = 0;
+  long long start = metrics_now();
+  for (int n = 0; n < iterations; ++n)
+    for (size_t i = 0; i < samples.size(); ++i) {
+      const std::string & t = samples[i].text;
+      // Any byte string is valid Latin-1.
+      free(convert_to_utf8(t.data(), t.size(), "iso-8859-1"));
+      ++calls;
+      bytes += t.size();
+    }
+  report("convert_to_utf8", calls, bytes, metrics_now() - start);
+}
+
+static void bench_fake_msgid(void)
+{
+  size_t calls = 0;
+  long long start = metrics_now();
+  for (int n = 0; n < iterations; ++n)
+    for (size_t i = 0; i < samples.size(); ++i) {
+      fake_msgid(samples[i].msg);
+      ++calls;
+    }
+  report("fake_msgid", calls, 0, metrics_now() - start);
+}
+
+static void bench_xapian_add_document(const char *dbdir)
+{
+  xapian_init((std::string(dbdir) + "/bench").c_str());
+  xapian_open_db_for_month("bench-201001", false);
+  std::string list("bench");
+  size_t calls = 0, bytes = 0;
+  long long ns = 0;
+  for (int n = 0; n < iterations; ++n)
+    for (size_t i = 0; i < samples.size(); ++i) {
+      document *d = parse_article(samples[i].msg);
+      if (d == NULL)
+	continue;
+      char buf[32];
+      sprintf(buf, "%d.%lu@bench", n, (unsigned long)i);
+      std::string msgid(buf);
+      long long start = metrics_now();
+      // Same msgnum each pass, so later passes replace documents.
+      xapian_add_document(d, msgid, list, 2010, 1, i);
+      ns += metrics_now() - start;
+      ++calls;
+      bytes += samples[i].text.size();
+    }
+  long long start = metrics_now();
+  xapian_fini();
+  ns += metrics_now() - start;
+  report("xapian_add_document", calls, bytes, ns);
+}
+
+int main(int argc, char **argv)
+{
+  int argi = 1;
+  if (argi + 1 < argc && strcmp(argv[argi], "-n") == 0) {
+    iterations = atoi(argv[argi + 1]);
+    argi += 2;
+  }
+  if (argi >= argc) {
+    fprintf(stderr, "usage: %s [-n iterations] mbox...\n", argv[0]);
+    return 1;
+  }
+
+  tokenizer_init();
+  std::vector<mbox> mboxes(argc - argi);
+  for (int i = argi; i < argc; ++i)
+    load(argv[i], mboxes[i - argi]);
+  printf("%lu messages, %d iterations\n",
+	 (unsigned long)samples.size(), iterations);
+
+  char dbdir[] = "/tmp/microbench.XXXXXX";
+  if (mkdtemp(dbdir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  check_parse_simple_article();
+  bench_parse_article();
+  bench_parse_simple_article();
+  bench_transform_text_html();
+  bench_save_body_bits();
+  bench_convert_to_utf8();
+  bench_fake_msgid();
+  bench_xapian_add_document(dbdir);
+
+  std::string rm = std::string("rm -rf ") + dbdir;
+  if (system(rm.c_str()) != 0)
+    fprintf(stderr, "could not remove %s\n", dbdir);
+
+  for (size_t i = 0; i < samples.size(); ++i)
+    g_object_unref(samples[i].msg);
+  for (size_t i = 0; i < mboxes.size(); ++i)
+    mbox_close(mboxes[i]);
+  tokenizer_fini();
+  return 0;
+}
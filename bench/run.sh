@@ -0,0 +1,41 @@
+#!/bin/sh
+# Benchmark the indexer on a synthetic corpus: the microbenchmarks, then
+# an end-to-end run of myindex into a temporary database.
+#
+# Options to gencorpus.py can be passed in GENCORPUS, myindex options
+# (e.g. "-j 4") in MYINDEX_OPTS, and the microbench iteration count in
+# ITERATIONS.  The corpus is cached in bench/corpus, keyed on GENCORPUS.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+GENCORPUS=${GENCORPUS:-"--seed 1 --lists 4 --months 3 --messages 500"}
+ITERATIONS=${ITERATIONS:-5}
+
+corpus=bench/corpus
+if [ ! -f $corpus/.options ] || [ "$(cat $corpus/.options)" != "$GENCORPUS" ]; then
+  rm -rf $corpus
+  python bench/gencorpus.py $GENCORPUS $corpus
+  echo "$GENCORPUS" > $corpus/.options
+fi
+
+mboxes=$(ls $corpus/*-*)
+messages=$(cat $mboxes | grep -c '^From ')
+bytes=$(cat $mboxes | wc -c)
+echo "corpus: $messages messages, $bytes bytes ($GENCORPUS)"
+echo
+
+./bench/microbench -n $ITERATIONS $mboxes
+echo
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+start=$(date +%s.%N)
+./myindex --dbname "$tmp/listdb" $MYINDEX_OPTS $mboxes > /dev/null
+end=$(date +%s.%N)
+echo "$start $end $messages $bytes" | awk '{
+  t = $2 - $1
+  printf "myindex end-to-end: %.2f s, %.0f messages/s, %.2f MB/s\n",
+         t, $3 / t, $4 / 1e6 / t
+}'
@@ -0,0 +1,160 @@
+#include "catalogue.h"
+#include "util.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sstream>
+
+using namespace std;
+
+#define CATALOGUE_MAGIC "debian-indexer-xapian catalogue 3"
+
+string catalogue_path(const string & dbpathprefix)
+{
+  string::size_type slash = dbpathprefix.find_last_of('/');
+  if (slash == string::npos)
+    return "." + dbpathprefix + ".catalogue";
+  return dbpathprefix.substr(0, slash + 1) + "." +
+         dbpathprefix.substr(slash + 1) + ".catalogue";
+}
+
+string catalogue_stamp(const string & path)
+{
+  DIR *dir = opendir(path.c_str());
+  if (dir == NULL)
+    return "";
+  unsigned long files = 0;
+  long long bytes = 0;
+  struct timespec latest = { 0, 0 };
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    struct stat st;
+    if (entry->d_name[0] == '.' ||
+        stat((path + "/" + entry->d_name).c_str(), &st) != 0)
+      continue;
+    files++;
+    bytes += st.st_size;
+    if (st.st_mtim.tv_sec > latest.tv_sec ||
+        (st.st_mtim.tv_sec == latest.tv_sec && st.st_mtim.tv_nsec > latest.tv_nsec))
+      latest = st.st_mtim;
+  }
+  closedir(dir);
+  char buf[96];
+  snprintf(buf, sizeof(buf), "%lu:%lld:%lld.%09ld", files, bytes,
+           (long long)latest.tv_sec, (long)latest.tv_nsec);
+  return buf;
+}
+
+/* Format:
+     CATALOGUE_MAGIC
+     shard <doccount> <lastdocid> <state> <stamp, or -> <path>
+     ...
+     month <list-month> <shard index> <doccount> <maxmsgnum>
+     ...
+     md5 <md5 of everything above>
+*/
+bool catalogue_load(const string & path, catalogue & cat)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+  string text((const char *)map, st.st_size);
+  munmap(map, st.st_size);
+
+  // The checksum line covers everything before it.
+  string::size_type sum = text.rfind("md5 ");
+  if (sum == string::npos || (sum != 0 && text[sum - 1] != '\n'))
+    return false;
+  string stored = text.substr(sum + 4);
+  while (!stored.empty() && stored[stored.size() - 1] == '\n')
+    stored.resize(stored.size() - 1);
+  if (stored != md5_hex(text.data(), sum))
+    return false;
+
+  catalogue loaded;
+  istringstream in(text.substr(0, sum));
+  string line;
+  if (!getline(in, line) || line != CATALOGUE_MAGIC)
+    return false;
+  while (getline(in, line)) {
+    istringstream fields(line);
+    string kind;
+    fields >> kind;
+    if (kind == "shard") {
+      shard_info s;
+      if (!(fields >> s.doccount >> s.lastdocid >> s.state >> s.stamp))
+        return false;
+      if (s.stamp == "-")
+        s.stamp.clear();
+      // The path is the rest of the line.
+      fields.ignore(1);
+      if (!getline(fields, s.path) || s.path.empty())
+        return false;
+      loaded.shards.push_back(s);
+    }
+    else if (kind == "month") {
+      string month;
+      month_info m;
+      if (!(fields >> month >> m.shard >> m.doccount >> m.maxmsgnum) ||
+          m.shard >= loaded.shards.size())
+        return false;
+      loaded.months[month] = m;
+    }
+    else {
+      return false;
+    }
+  }
+  cat = loaded;
+  return true;
+}
+
+bool catalogue_save(const string & path, const catalogue & cat)
+{
+  ostringstream out;
+  out << CATALOGUE_MAGIC << '\n';
+  for (size_t i = 0; i < cat.shards.size(); ++i) {
+    const shard_info & s = cat.shards[i];
+    out << "shard " << s.doccount << ' ' << s.lastdocid << ' ' << s.state
+        << ' ' << (s.stamp.empty() ? "-" : s.stamp) << ' ' << s.path << '\n';
+  }
+  for (map<string, month_info>::const_iterator i = cat.months.begin();
+       i != cat.months.end(); ++i) {
+    out << "month " << i->first << ' ' << i->second.shard << ' '
+        << i->second.doccount << ' ' << i->second.maxmsgnum << '\n';
+  }
+  string text = out.str();
+  text += "md5 " + md5_hex(text.data(), text.size()) + "\n";
+
+  // Write to a temporary file and rename it over the old one, so readers
+  // see either the old catalogue or the new one.
+  string tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (f == NULL)
+    return false;
+  bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+  ok = (fflush(f) == 0) && ok;
+  ok = (fsync(fileno(f)) == 0) && ok;
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
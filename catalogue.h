@@ -0,0 +1,59 @@
+#ifndef CATALOGUE_H
+#define CATALOGUE_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+/* On-disk record of which shard each list-month lives in, so that
+   startup doesn't have to open every shard and walk its XM terms.  It is
+   rewritten atomically at each xapian_flush(); the doc count and last
+   docid recorded per shard let a stale catalogue be detected, in which
+   case it is rebuilt from the shards.  Each shard's stamp, taken when
+   its counts were, spares opening the shards that haven't changed
+   since to check them. */
+
+/* maxmsgnum of a month whose Q terms haven't been looked at yet. */
+#define MAXMSGNUM_UNKNOWN (-2)
+
+/* A shard takes new months until it reaches its size limit and is
+   sealed; a sealed shard gets compacted in the background (--compact).
+   The state is also kept in the shard as user metadata "XS". */
+enum shard_state {
+  SHARD_OPEN = 0,
+  SHARD_SEALED,
+  SHARD_COMPACTED
+};
+
+typedef struct {
+  std::string path;
+  unsigned long doccount;
+  unsigned long lastdocid;
+  int state;               /* a shard_state */
+  std::string stamp;       /* catalogue_stamp(), or "" if not taken */
+} shard_info;
+
+typedef struct {
+  size_t shard;            /* index into catalogue::shards */
+  unsigned long doccount;
+  int maxmsgnum;           /* -1 if none, or MAXMSGNUM_UNKNOWN */
+} month_info;
+
+typedef struct {
+  std::vector<shard_info> shards;
+  std::map<std::string, month_info> months;
+} catalogue;
+
+/* Where the catalogue for shards dbpathprefix-NNN lives.  It is a dot
+   file so that globbing for the shards doesn't pick it up. */
+std::string catalogue_path(const std::string & dbpathprefix);
+
+/* The number, total size and latest mtime of the files in the shard
+   at path, which a commit changes, as a word; "" if it can't be read. */
+std::string catalogue_stamp(const std::string & path);
+
+/* False if the file is missing or doesn't pass its checksum. */
+bool catalogue_load(const std::string & path, catalogue & cat);
+bool catalogue_save(const std::string & path, const catalogue & cat);
+
+#endif
@@ -0,0 +1,129 @@
+#include "compact.h"
+#include "util.h"
+
+#include <xapian.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <iostream>
+
+using namespace std;
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+long long shard_bytes(const string & path)
+{
+  DIR *dir = opendir(path.c_str());
+  if (dir == NULL)
+    return 0;
+  long long total = 0;
+  struct dirent *e;
+  while ((e = readdir(dir)) != NULL) {
+    struct stat st;
+    string fn = path + "/" + e->d_name;
+    if (stat(fn.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      total += st.st_size;
+  }
+  closedir(dir);
+  return total;
+}
+
+static int remove_entry(const char *fn, const struct stat *, int, struct FTW *)
+{
+  return remove(fn);
+}
+
+static void remove_tree(const string & path)
+{
+  nftw(path.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// Swap two directories in one step where the kernel can; otherwise there
+// is a moment where a searcher opening path finds nothing there.
+static bool exchange(const string & a, const string & b)
+{
+#ifdef SYS_renameat2
+  if (syscall(SYS_renameat2, AT_FDCWD, a.c_str(), AT_FDCWD, b.c_str(),
+              RENAME_EXCHANGE) == 0)
+    return true;
+  if (errno != ENOSYS && errno != EINVAL)
+    return false;
+#endif
+  string old = b + ".old";
+  if (rename(a.c_str(), old.c_str()) != 0)
+    return false;
+  if (rename(b.c_str(), a.c_str()) != 0) {
+    rename(old.c_str(), a.c_str());
+    return false;
+  }
+  return rename(old.c_str(), b.c_str()) == 0;
+}
+
+string shard_sibling(const string & path, const char *what)
+{
+  size_t slash = path.find_last_of('/');
+  string dir = (slash == string::npos) ? string() : path.substr(0, slash + 1);
+  string base = (slash == string::npos) ? path : path.substr(slash + 1);
+  return dir + "." + base + "." + what;
+}
+
+bool swap_shard(const string & path, const string & replacement)
+{
+  if (! exchange(path, replacement))
+    return false;
+  // replacement now holds the old copy.
+  remove_tree(replacement);
+  return true;
+}
+
+bool compact_shard(const string & path)
+{
+  string tmp = shard_sibling(path, "compact");
+  remove_tree(tmp);
+
+  long long before = shard_bytes(path);
+  try {
+    // Holding the write lock keeps other indexers out until the swap.
+    Xapian::WritableDatabase locked(path, Xapian::DB_OPEN);
+#if XAPIAN_MAJOR_VERSION > 1 || (XAPIAN_MAJOR_VERSION == 1 && XAPIAN_MINOR_VERSION >= 4)
+    Xapian::Database(path).compact(tmp, Xapian::DBCOMPACT_FULLER |
+                                        Xapian::DBCOMPACT_NO_RENUMBER);
+#else
+    Xapian::Compactor compactor;
+    compactor.set_compaction_level(Xapian::Compactor::FULLER);
+    compactor.set_renumber(false);
+    compactor.set_destdir(tmp);
+    compactor.add_source(path);
+    compactor.compact();
+#endif
+    {
+      Xapian::WritableDatabase out(tmp, Xapian::DB_OPEN);
+      out.set_metadata("XS", "compacted");
+      out.commit();
+    }
+    if (! swap_shard(path, tmp)) {
+      cerr << "Cannot swap in compacted " << path << ": " << strerror(errno) << endl;
+      remove_tree(tmp);
+      return false;
+    }
+  } catch (const Xapian::Error &e) {
+    cerr << "Cannot compact " << path << ": " << e.get_msg() << endl;
+    remove_tree(tmp);
+    return false;
+  }
+  if (verbose > 0)
+    cout << "compacted " << path << ": " << before << " -> "
+         << shard_bytes(path) << " bytes" << endl;
+  return true;
+}
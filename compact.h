@@ -0,0 +1,27 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <string>
+
+/* Sealed shards no longer take new months, so they can be rewritten
+   read-optimised, as xapian-compact does.  The compacted copy is built in
+   a hidden sibling directory (which the shard glob doesn't match) while
+   the shard's write lock is held, marked SHARD_COMPACTED, then swapped in
+   with a single renameat2(RENAME_EXCHANGE).  Searchers with the old copy
+   open keep reading it until they reopen.  Docids are kept. */
+
+/* A hidden sibling of the shard at path, named for what is built there. */
+std::string shard_sibling(const std::string & path, const char *what);
+
+/* Put the database at replacement in place of the shard at path, then
+   remove the old copy.  On failure both are left as they were. */
+bool swap_shard(const std::string & path, const std::string & replacement);
+
+/* The on-disk size of the shard at path, in bytes. */
+long long shard_bytes(const std::string & path);
+
+/* Compact the shard at path in place.  Returns false, and leaves the
+   shard as it was, on failure. */
+bool compact_shard(const std::string & path);
+
+#endif
@@ -0,0 +1,308 @@
+#include "debindex.h"
+#include "tokenizer.h"
+#include "xapianglue.h"
+#include "util.h"
+#include "mbox.h"
+#include "metrics.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fstream>
+#include <iostream>
+
+#include <xapian.h>
+
+using namespace std;
+
+/* How long to wait for an index that another indexer has open, such as
+   a myindex run, before giving up with EX_TEMPFAIL. */
+#define DEBINDEX_LOCK_WAIT 10
+
+static pthread_mutex_t debindex_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set once an error has closed the index, until debindex_init().
+static bool failed = false;
+
+/* Report e, after which nothing is known of the state of the index,
+   and close it without saving anything more; returns result. */
+static debindex_result fail(const Xapian::Error & e, debindex_result result)
+{
+  cerr << "debindex: " << e.get_msg() << endl;
+  xapian_abandon();
+  tokenizer_fini();
+  failed = true;
+  return result;
+}
+
+debindex_result debindex_init(const char *dbpathprefix)
+{
+  pthread_mutex_lock(&debindex_lock);
+  debindex_result result = DEBINDEX_OK;
+  failed = false;
+  tokenizer_init();
+  xapian_set_throw_errors(true);
+  xapian_set_lock_wait(DEBINDEX_LOCK_WAIT);
+  try {
+    xapian_init(dbpathprefix);
+  } catch (const Xapian::DatabaseLockError &e) {
+    result = fail(e, DEBINDEX_LOCKED);
+  } catch (const Xapian::Error &e) {
+    result = fail(e, DEBINDEX_ERROR);
+  }
+  start_time = time(NULL);
+  pthread_mutex_unlock(&debindex_lock);
+  return result;
+}
+
+debindex_result debindex_fini(void)
+{
+  pthread_mutex_lock(&debindex_lock);
+  debindex_result result = DEBINDEX_OK;
+  if (! failed) {
+    try {
+      xapian_fini();
+      tokenizer_fini();
+    } catch (const Xapian::Error &e) {
+      result = fail(e, DEBINDEX_ERROR);
+    }
+  }
+  pthread_mutex_unlock(&debindex_lock);
+  return result;
+}
+
+debindex_result debindex_flush(void)
+{
+  pthread_mutex_lock(&debindex_lock);
+  debindex_result result = DEBINDEX_ERROR;
+  if (! failed) {
+    try {
+      xapian_flush();
+      result = DEBINDEX_OK;
+    } catch (const Xapian::Error &e) {
+      result = fail(e, DEBINDEX_ERROR);
+    }
+  }
+  pthread_mutex_unlock(&debindex_lock);
+  return result;
+}
+
+debindex_result debindex_set_language(const string & language)
+{
+  pthread_mutex_lock(&debindex_lock);
+  debindex_result result = DEBINDEX_ERROR;
+  if (! failed) {
+    try {
+      xapian_set_stemmer(language);
+      result = DEBINDEX_OK;
+    } catch (const Xapian::Error &e) {
+      result = fail(e, DEBINDEX_ERROR);
+    }
+  }
+  pthread_mutex_unlock(&debindex_lock);
+  return result;
+}
+
+string msgid_strip(string aline)
+{
+   size_t l = aline.find_first_of('<');
+   size_t r = aline.find_last_of('>');
+   if (l<r)
+     return aline.substr(l+1,r-l-1);
+   return aline;
+}
+
+void debindex_read_spamids(const string & spamfn, set<string> & spamids)
+{
+  ifstream spamf(spamfn.c_str());
+  if (spamf) {
+     string aline;
+     while (getline(spamf, aline)) {
+	string::iterator i = aline.begin();
+	while (i != aline.end() && *i != ':') {
+	   if (isalnum((unsigned char)*i) || strchr(".-+*", *i)) {
+	      *i = tolower(*i);
+	      i++;
+	   } else {
+	      aline.erase(i);
+	   }
+	}
+	if (aline.substr(0,21) == "skip-spam-message-id:") {
+	  aline.erase(0,21);
+	  i = aline.begin();
+	  while (i != aline.end() && *i == ' ')
+	    aline.erase(i);
+	  spamids.insert(msgid_strip(aline));
+	}
+     }
+  }
+}
+
+/* The MIME tree of the len bytes at data, which must outlive it. */
+static GMimeMessage *parse_buffer(const char *data, size_t len, GByteArray & slice)
+{
+  slice.data = (guint8 *)data;
+  slice.len = len;
+  GMimeStream *stream = g_mime_stream_mem_new();
+  // The stream doesn't own the slice, so won't try to free data.
+  g_mime_stream_mem_set_byte_array(GMIME_STREAM_MEM(stream), &slice);
+  GMimeMessage *msg = mbox_parse_stream(stream);
+  g_object_unref(stream);
+  return msg;
+}
+
+// debindex_add() with debindex_lock held.
+static bool add_message(const char *data, size_t len, GMimeMessage *msg,
+			string & msgid, string & list, int year, int month, int msgnum)
+{
+  long long started = metrics_now();
+  GByteArray slice;
+  GMimeMessage *parsed = NULL;
+  document * doc = NULL;
+  if (msg == NULL)
+    doc = parse_simple_article(data, len);
+  if (doc == NULL) {
+    if (msg == NULL)
+      msg = parsed = parse_buffer(data, len, slice);
+    if (msg != NULL)
+      doc = parse_article(msg);
+  }
+  try {
+    if (doc != NULL)
+      xapian_add_document(doc, msgid, list, year, month, msgnum);
+  } catch (...) {
+    if (parsed != NULL)
+      g_object_unref(parsed);
+    throw;
+  }
+  if (parsed != NULL)
+    g_object_unref(parsed);
+  metrics_note_message_cost(metrics_now() - started);
+  return doc != NULL;
+}
+
+bool debindex_add(const char *data, size_t len, GMimeMessage *msg,
+		  string & msgid, string & list, int year, int month, int msgnum)
+{
+  pthread_mutex_lock(&debindex_lock);
+  bool added = false;
+  if (! failed) {
+    try {
+      added = add_message(data, len, msg, msgid, list, year, month, msgnum);
+    } catch (const Xapian::Error &e) {
+      fail(e, DEBINDEX_ERROR);
+    }
+  }
+  pthread_mutex_unlock(&debindex_lock);
+  return added;
+}
+
+// debindex_classify() with debindex_lock held.
+static debindex_result classify(const string & msgid, set<string> *seenids,
+				const set<string> *spamids, bool look_in_index,
+				const string & list, int year, int month, int msgnum)
+{
+  debindex_result result;
+  if (msgid == "")
+    result = DEBINDEX_NO_MSGID;
+  else if (seenids != NULL && seenids->count(msgid))
+    result = DEBINDEX_DUPLICATE;
+  else if (look_in_index && xapian_msgid_taken(msgid, list, year, month, msgnum))
+    result = DEBINDEX_DUPLICATE;
+  else if (spamids != NULL && spamids->count(msgid))
+    result = DEBINDEX_SPAM;
+  else
+    result = DEBINDEX_INDEXED;
+  if (seenids != NULL && debindex_numbered(result))
+    seenids->insert(msgid);
+  return result;
+}
+
+debindex_result debindex_classify(const string & msgid, set<string> *seenids,
+				  const set<string> *spamids, bool look_in_index,
+				  const string & list, int year, int month, int msgnum)
+{
+  pthread_mutex_lock(&debindex_lock);
+  debindex_result result = DEBINDEX_ERROR;
+  if (! failed) {
+    try {
+      result = classify(msgid, seenids, spamids, look_in_index,
+			list, year, month, msgnum);
+    } catch (const Xapian::DatabaseLockError &e) {
+      result = fail(e, DEBINDEX_LOCKED);
+    } catch (const Xapian::Error &e) {
+      result = fail(e, DEBINDEX_ERROR);
+    }
+  }
+  pthread_mutex_unlock(&debindex_lock);
+  return result;
+}
+
+bool debindex_numbered(debindex_result r)
+{
+  return r == DEBINDEX_INDEXED || r == DEBINDEX_SPAM;
+}
+
+debindex_result debindex_message(const char *data, size_t len,
+				 const string & list, int year, int month,
+				 int msgnum, const set<string> *spamids)
+{
+  pthread_mutex_lock(&debindex_lock);
+  if (failed) {
+    pthread_mutex_unlock(&debindex_lock);
+    return DEBINDEX_ERROR;
+  }
+
+  GByteArray slice;
+  GMimeMessage *msg = NULL;
+  string msgid;
+  string raw_msgid;
+  if (header_message_id(data, len, raw_msgid)) {
+    msgid = msgid_strip(raw_msgid);
+  }
+  else {
+    msg = parse_buffer(data, len, slice);
+    if (msg == NULL) {
+      // As in myindex, it takes no number.
+      pthread_mutex_unlock(&debindex_lock);
+      return DEBINDEX_UNPARSABLE;
+    }
+    const char* gmime_msgid = g_mime_object_get_header(GMIME_OBJECT(msg), "Message-Id");
+    if (gmime_msgid != NULL)
+      msgid = msgid_strip(gmime_msgid);
+    else
+      msgid = fake_msgid(msg);
+  }
+
+  char yearmonth[16];
+  if (month != 0)
+    sprintf(yearmonth, "%04d%02d", year, month);
+  else
+    sprintf(yearmonth, "%04d", year);
+  string mlist(list);
+  debindex_result result;
+  try {
+    long last = xapian_open_db_for_month(mlist + "-" + yearmonth, false);
+    if (msgnum < 0)
+      msgnum = last + 1;
+    result = classify(msgid, NULL, spamids, true, list, year, month, msgnum);
+    if (result == DEBINDEX_SPAM) {
+      xapian_delete_document(mlist, year, month, msgnum, msgid);
+    }
+    else if (result == DEBINDEX_INDEXED &&
+	     ! add_message(data, len, msg, msgid, mlist, year, month, msgnum)) {
+      // It keeps msgnum, with nothing there.
+      xapian_delete_document(mlist, year, month, msgnum, msgid);
+      result = DEBINDEX_UNPARSABLE;
+    }
+  } catch (const Xapian::DatabaseLockError &e) {
+    result = fail(e, DEBINDEX_LOCKED);
+  } catch (const Xapian::Error &e) {
+    result = fail(e, DEBINDEX_ERROR);
+  }
+  if (msg != NULL)
+    g_object_unref(msg);
+  pthread_mutex_unlock(&debindex_lock);
+  return result;
+}
@@ -0,0 +1,100 @@
+#ifndef DEBINDEX_H
+#define DEBINDEX_H
+
+#include <gmime/gmime.h>
+#include <set>
+#include <string>
+
+/* libdebindex: what myindex does with each message of an mbox, for
+   indexing messages one at a time from memory, as an archiver delivers
+   them.
+
+   It is not reentrant.  The shards, catalogue and parse state are the
+   globals of xapianglue.cc and tokenizer.cc, so there is one index open
+   per process.  Calls may come from any thread, but each function below
+   holds one process-wide lock throughout, so they run one at a time,
+   however many threads call them.  The exceptions are those that touch
+   no index state: msgid_strip(), debindex_read_spamids() and
+   debindex_numbered().
+
+   An index another process is writing to is waited for, for a few
+   seconds, and DEBINDEX_LOCKED returned if it is still locked, for a
+   delivery to be retried later.  Any other error from Xapian is reported
+   on stderr and returns DEBINDEX_ERROR.  Either way the index is closed,
+   what was indexed since the last flush may or may not have been
+   committed, and until debindex_init() opens it again every call
+   returns DEBINDEX_ERROR, or false from debindex_add().  myindex, which
+   opens the index itself and calls only debindex_add() and
+   debindex_classify(), still aborts on errors. */
+
+enum debindex_result {
+  DEBINDEX_OK = 0,		/* from debindex_init(), _flush() and so on */
+  DEBINDEX_INDEXED = 0,
+  DEBINDEX_SPAM,		/* in spamids, so deleted instead */
+  DEBINDEX_DUPLICATE,		/* its message-id is already in the month */
+  DEBINDEX_NO_MSGID,
+  DEBINDEX_UNPARSABLE,
+  DEBINDEX_LOCKED,		/* another process has the index */
+  DEBINDEX_ERROR
+};
+
+/* Open the index at dbpathprefix (NULL for the default), as myindex
+   --dbname does.  No other process may write to it until
+   debindex_fini(). */
+debindex_result debindex_init(const char *dbpathprefix);
+/* Commit, and close the index. */
+debindex_result debindex_fini(void);
+/* Commit what has been indexed so far. */
+debindex_result debindex_flush(void);
+/* The stemming language for the messages that follow, as myindex -l. */
+debindex_result debindex_set_language(const std::string & language);
+
+/* The message-id in a Message-Id: header, without the angle brackets. */
+std::string msgid_strip(std::string aline);
+
+/* Add the message-ids listed in spamfn, the .spam file of an mbox, to
+   spamids.  A missing file lists none. */
+void debindex_read_spamids(const std::string & spamfn, std::set<std::string> & spamids);
+
+/* Parse the len bytes of a message at data and add it to the month
+   opened last as msgnum, under msgid.  msg, if not NULL, is the message
+   already parsed.  Returns false if it can't be parsed, or on an
+   error. */
+bool debindex_add(const char *data, size_t len, GMimeMessage *msg,
+		  std::string & msgid, std::string & list, int year, int month,
+		  int msgnum);
+
+/* What becomes of a message with msgid in the month opened last, were
+   it to take msgnum: DEBINDEX_NO_MSGID if msgid is empty; a duplicate
+   if it is in seenids or, if look_in_index, took another number in the
+   month in an earlier run; DEBINDEX_SPAM if it is in spamids; otherwise
+   DEBINDEX_INDEXED.  seenids and spamids may be NULL, for none.  A
+   message that is to take a number is added to seenids.  myindex and
+   debindex_message() both number messages by this. */
+debindex_result debindex_classify(const std::string & msgid,
+				  std::set<std::string> *seenids,
+				  const std::set<std::string> *spamids,
+				  bool look_in_index, const std::string & list,
+				  int year, int month, int msgnum);
+
+/* Whether a message classified as r takes a msgnum: spam does, and so
+   does a message to be indexed even if it then can't be parsed.  A
+   duplicate, a message with no message-id, and one unparsable before
+   its message-id is known don't. */
+bool debindex_numbered(debindex_result r);
+
+/* Index one message of list's archive for year and month (0 for lists
+   archived by year), from data, its raw RFC 822 text without a From_
+   line.  msgnum is the number it takes in the month's mbox, if it takes
+   one, counting as myindex does; if negative, the next after the
+   highest so far, which is right for messages indexed as they are
+   delivered.  Whether it takes a number is as debindex_numbered() says,
+   looking in the index for duplicates, so a message delivered again at
+   its own msgnum is indexed again.  A message whose message-id is in
+   spamids, if given, deletes what is at msgnum; one that takes msgnum
+   but can't be parsed leaves it empty. */
+debindex_result debindex_message(const char *data, size_t len,
+				 const std::string & list, int year, int month,
+				 int msgnum, const std::set<std::string> *spamids);
+
+#endif
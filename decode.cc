@@ -0,0 +1,167 @@
+#include "decode.h"
+
+#include <ctype.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* The value of each base64 character, or 0xff for those skipped.  As in
+   GMime, '=' counts as 0 and is accounted for at the end. */
+static struct base64_ranks {
+  unsigned char r[256];
+  base64_ranks() {
+    const char *alphabet =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    memset(r, 0xff, sizeof(r));
+    for (int i = 0; i < 64; i++)
+      r[(unsigned char)alphabet[i]] = i;
+    r[(unsigned char)'='] = 0;
+  }
+} base64_rank;
+
+#ifdef __SSE2__
+static inline __m128i in_range(__m128i c, char lo, char hi)
+{
+  return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)),
+		       _mm_cmplt_epi8(c, _mm_set1_epi8(hi + 1)));
+}
+
+/* Decode 16 characters to 12 bytes, if they are all in the alphabet
+   (so no line break or padding). */
+static inline bool base64_block(const char *in, char *out)
+{
+  __m128i c = _mm_loadu_si128((const __m128i *)in);
+  __m128i upper = in_range(c, 'A', 'Z');
+  __m128i lower = in_range(c, 'a', 'z');
+  __m128i digit = in_range(c, '0', '9');
+  __m128i plus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+  __m128i slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+  __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+			       _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+  if (_mm_movemask_epi8(valid) != 0xffff)
+    return false;
+
+  __m128i v = _mm_or_si128(
+    _mm_or_si128(_mm_and_si128(upper, _mm_sub_epi8(c, _mm_set1_epi8('A'))),
+		 _mm_and_si128(lower, _mm_sub_epi8(c, _mm_set1_epi8('a' - 26)))),
+    _mm_or_si128(_mm_and_si128(digit, _mm_add_epi8(c, _mm_set1_epi8(52 - '0'))),
+		 _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62)),
+			      _mm_and_si128(slash, _mm_set1_epi8(63)))));
+  // Join pairs of 6-bit values into 12 bits, then pairs of those into 24.
+  __m128i v12 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xff)), 6),
+			     _mm_srli_epi16(v, 8));
+  __m128i v24 = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(v12, _mm_set1_epi32(0xffff)), 12),
+			     _mm_srli_epi32(v12, 16));
+  unsigned int w[4];
+  _mm_storeu_si128((__m128i *)w, v24);
+  for (int k = 0; k < 4; k++) {
+    out[3 * k] = w[k] >> 16;
+    out[3 * k + 1] = w[k] >> 8;
+    out[3 * k + 2] = w[k];
+  }
+  return true;
+}
+#endif
+
+size_t base64_decode(const char *in, size_t len, char *out, size_t max)
+{
+  const unsigned char *p = (const unsigned char *)in;
+  const unsigned char *end = p + len;
+  char *o = out;
+  char *limit = out + max;
+  unsigned int saved = 0;
+  int n = 0;
+
+  while (p < end) {
+#ifdef __SSE2__
+    // The bulk of each line goes 16 characters at a time.
+    if (n == 0) {
+      while (end - p >= 16 && limit - o >= 12 &&
+	     base64_block((const char *)p, o)) {
+	p += 16;
+	o += 12;
+      }
+      if (p == end)
+	break;
+    }
+#endif
+    unsigned char c = base64_rank.r[*p++];
+    if (c == 0xff)
+      continue;
+    saved = (saved << 6) | c;
+    if (++n == 4) {
+      if (limit - o < 3) {
+	// Out of room, so the rest of the input doesn't matter.
+	if (o < limit) *o++ = saved >> 16;
+	if (o < limit) *o++ = saved >> 8;
+	return o - out;
+      }
+      *o++ = saved >> 16;
+      *o++ = saved >> 8;
+      *o++ = saved;
+      n = 0;
+    }
+  }
+
+  // Drop an output byte for each '=' in the last two characters.
+  for (int i = 2; p > (const unsigned char *)in && i; ) {
+    --p;
+    if (base64_rank.r[*p] != 0xff) {
+      if (*p == '=' && n == 0 && o > out)
+	o--;
+      i--;
+    }
+  }
+  return o - out;
+}
+
+static inline int hex_value(unsigned char c)
+{
+  return isdigit(c) ? c - '0' : toupper(c) - 'A' + 10;
+}
+
+size_t qp_decode(const char *in, size_t len, char *out, size_t max)
+{
+  const char *p = in;
+  const char *end = in + len;
+  char *o = out;
+  char *limit = out + max;
+
+  while (p < end && o < limit) {
+    // Copy up to the next '=' in one go; memchr is vectorised.
+    const char *eq = (const char *)memchr(p, '=', end - p);
+    size_t n = (eq ? eq : end) - p;
+    if (n > (size_t)(limit - o))
+      n = limit - o;
+    memcpy(o, p, n);
+    o += n;
+    p += n;
+    if (p != eq || o == limit)
+      continue;
+
+    // As GMime, an escape cut short by the end of the content is dropped.
+    if (end - p < 2)
+      break;
+    if (p[1] == '\n') {
+      // Soft line break.
+      p += 2;
+      continue;
+    }
+    if (end - p < 3)
+      break;
+    unsigned char a = p[1], b = p[2];
+    p += 3;
+    if (isxdigit(a) && isxdigit(b)) {
+      *o++ = (hex_value(a) << 4) | hex_value(b);
+    } else if (a == '\r' && b == '\n') {
+      // Soft line break.
+    } else {
+      // Invalid, so passed through.
+      const char pass[3] = { '=', (char)a, (char)b };
+      for (int k = 0; k < 3 && o < limit; k++)
+	*o++ = pass[k];
+    }
+  }
+  return o - out;
+}
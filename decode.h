@@ -0,0 +1,20 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stddef.h>
+
+/* Content-Transfer-Encoding decoders for the parts we index, giving the
+   same bytes as GMime's basic filters when the whole content is decoded
+   in one go.  They write to a buffer the caller provides (and can reuse
+   from message to message) rather than a stream, and return the number
+   of bytes written.  They stop once max bytes have been written, without
+   looking at the rest of the input. */
+
+/* out must have room for BASE64_DECODED_MAX(len) bytes, or max if less. */
+#define BASE64_DECODED_MAX(len) ((len) / 4 * 3 + 3)
+size_t base64_decode(const char *in, size_t len, char *out, size_t max);
+
+/* out must have room for len bytes, or max if less. */
+size_t qp_decode(const char *in, size_t len, char *out, size_t max);
+
+#endif
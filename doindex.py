@@ -17,7 +17,7 @@
 # Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 import re, time
-import glob, os, sys
+import glob, os, select, sys, subprocess, tempfile
 from langcodes import langcodes
 
 cfgfile = '/srv/lists.debian.org/smartlist/.etc/lists.cfg'
@@ -79,11 +79,51 @@ startopts = ['myindex']
 cmdlopts = sys.argv[1:]
 timestampfn = None
 dousage = False
+dbname = '/srv/lists.debian.org/xapian/data/listdb' # as in xapianglue.cc
+processes = 1
+metrics = None
 
-while cmdlopts and cmdlopts[0] in ['-F', '-v','--dbname']:
-  if cmdlopts[0] in ['--dbname']:
-    startopts.append(cmdlopts.pop(0))
-  startopts.append(cmdlopts.pop(0))
+while cmdlopts and cmdlopts[0] in ['-F', '-v','--dbname','--compact','--rebuild',
+                                   '--no-body-positions','--quoted','--latency',
+                                   '--shard-docs','--shard-bytes','--metrics',
+                                   '--processes']:
+  opt = cmdlopts.pop(0)
+  if opt == '--dbname':
+    dbname = cmdlopts.pop(0)
+  elif opt == '--processes':
+    processes = max(1, int(cmdlopts.pop(0)))
+  elif opt == '--metrics':
+    metrics = cmdlopts.pop(0)
+  else:
+    startopts.append(opt)
+    if opt in ['--quoted','--latency','--shard-docs','--shard-bytes']:
+      startopts.append(cmdlopts.pop(0))
+
+def indexed_list(ln):
+  if ln not in listinfo:
+    print ln,"not found, skipping"
+  elif ln in skip:
+    print ln,"skipped by config"
+  elif listinfo[ln]["section"] in ["spi","lsb","other"]:
+    print ln,"is in section",listinfo[ln]["section"]+", skipping"
+  else:
+    return True
+  return False
+
+if cmdlopts == ['--watch']:
+  # Index new messages as they arrive, until killed.
+  languages = tempfile.NamedTemporaryFile(prefix='doindex-languages.')
+  for ln in k:
+    if indexed_list(ln):
+      print >> languages, ln, get_lang(ln)
+  languages.flush()
+  opts = (startopts[:1] + ['--dbname',dbname] + startopts[1:] +
+          ['--languages',languages.name,'--watch',mboxdir])
+  if metrics:
+    opts[3:3] = ['--metrics',metrics]
+  if os.spawnv(os.P_WAIT,'./myindex', opts):
+    raise Exception("myindex %s returned error"%' '.join(opts))
+  sys.exit()
 if cmdlopts and cmdlopts[0] in ['--all','--timestamp']:
   if ((cmdlopts[0]=='--all' and len(cmdlopts)>1) or
       (cmdlopts[0]=='--timestamp' and len(cmdlopts)!=2)):
@@ -109,38 +149,109 @@ if dousage:
   print """usage: %s listmbox [listmbox ...]
 
 or     %s --all
-"""%(sys.argv[0],sys.argv[0])
+or     %s --timestamp file
+or     %s --watch
+"""%((sys.argv[0],)*4)
   sys.exit()
 
-lastlang = None
-opts = startopts[:]
+# Each of the processes indexes into a series of shards of its own:
+# the first into dbname-NNN, the others into dbname-jKK-NNN.  A month
+# already in one of them goes back to the process that owns it, as the
+# process itself reports from its shards; new months go to whichever
+# process has least to do.  A series left by an earlier run with more
+# processes would have none to own it, and its months would be indexed
+# a second time into another, so that is refused.
+series = [dbname] + ['%s-j%02d'%(dbname,n) for n in range(1,processes)]
+for shard in glob.glob(dbname+'-j[0-9][0-9]-[0-9][0-9][0-9]*'):
+  prefix = shard[:len(dbname)+4]
+  if prefix not in series:
+    print >> sys.stderr, ("%s is indexed by a process of its own: "
+                          "use --processes %d or more"%(prefix,int(prefix[-2:])+1))
+    sys.exit(1)
+
+servers = []
+for n in range(processes):
+  opts = startopts[:1] + ['--serve','--dbname',series[n]] + startopts[1:]
+  # Each process writes its own metrics, to the file named with its
+  # series' -jKK suffix, if any.
+  if metrics:
+    opts[4:4] = ['--metrics',metrics+series[n][len(dbname):]]
+  servers.append(subprocess.Popen(opts, executable='./myindex',
+                                  stdin=subprocess.PIPE, stdout=subprocess.PIPE))
+
+owner = {}
+for n in range(processes):
+  servers[n].stdin.write('months\n')
+  servers[n].stdin.flush()
+  reply = servers[n].stdout.readline().rstrip('\n').split('\t')
+  if reply[:2] != ['ok','months']:
+    raise Exception("myindex for %s cannot list its months"%series[n])
+  for m in reply[2:]:
+    owner[m] = n
+
+# Longest first, so the big yearly mboxes don't hold up the end of the
+# run.  Each queue is kept largest first.
+jobs = []
 for anmbox in mboxestoindex:
   bn = os.path.basename(anmbox)
   ln, month = bn.rsplit('-',1)
 
-  if ln not in listinfo:
-    print ln,"not found, skipping"
-  elif ln in skip:
-    print ln,"skipped by config"
-  elif listinfo[ln]["section"] in ["spi","lsb","other"]:
-    print ln,"is in section",listinfo[ln]["section"]+", skipping"
-  else:
+  if indexed_list(ln):
     lang = get_lang(ln)
     #print "bn",bn,"ln",ln,"month",month,"lang",lang
     #print "doing index for %s with lang %s..."%(ln,lang)
-    if lang != lastlang:
-      opts += ['-l',lang]
-      lastlang = lang
-    opts.append(anmbox)
-  if len(opts)>1000:
-    #print "calling %s"%(' '.join(opts))
-    if os.spawnv(os.P_WAIT,'./myindex', opts):
-      raise Exception("myindex %s returned error"%' '.join(opts))
-    opts = startopts[:]
-    lastlang = None
-
-#print "calling %s"%(' '.join(opts))
-if os.spawnv(os.P_WAIT,'./myindex', opts):
-  raise Exception("myindex %s returned error"%' '.join(opts))
+    try:
+      size = os.stat(anmbox).st_size
+    except OSError:
+      size = 0
+    jobs.append((size, anmbox, lang, owner.get(bn)))
+jobs.sort(reverse=True)
+queues = [[] for n in range(processes)]
+load = [0]*processes
+for size, anmbox, lang, n in jobs:
+  free = n is None
+  if free:
+    n = load.index(min(load))
+  queues[n].append((size, anmbox, lang, free))
+  load[n] += size
+
+def next_job(n):
+  if queues[n]:
+    return queues[n].pop(0)
+  # Steal the biggest new month from the process with most left to do.
+  for v in sorted(range(processes), key=lambda v: -sum([j[0] for j in queues[v]])):
+    for i in range(len(queues[v])):
+      if queues[v][i][3]:
+        return queues[v].pop(i)
+  return None
+
+running = {}
+def dispatch(n):
+  job = next_job(n)
+  if job:
+    servers[n].stdin.write('index\t%s\t%s\n'%(job[1],job[2]))
+    servers[n].stdin.flush()
+    running[servers[n].stdout.fileno()] = (n, job[1])
+
+for n in range(processes):
+  dispatch(n)
+while running:
+  ready = select.select(running.keys(), [], [])[0]
+  for fd in ready:
+    n, anmbox = running.pop(fd)
+    reply = servers[n].stdout.readline()
+    if not reply:
+      raise Exception("myindex for %s exited with %s"%(series[n],servers[n].wait()))
+    reply = reply.rstrip('\n').split('\t')
+    if reply[0] != 'ok':
+      print >> sys.stderr, "Cannot index %s: %s"%(anmbox,' '.join(reply[2:]))
+    dispatch(n)
+
+for server in servers:
+  server.stdin.write('quit\n')
+  server.stdin.close()
+for n in range(processes):
+  if servers[n].wait():
+    raise Exception("myindex for %s returned error"%series[n])
 if timestampfn:
   print >> open(timestampfn,"w"), thisruntimestamp
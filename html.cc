@@ -0,0 +1,234 @@
+#include "html.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* Elements which start a new line when rendered. */
+static const char * const block_elements[] = {
+  "address", "article", "aside", "blockquote", "body", "br", "caption",
+  "center", "dd", "div", "dl", "dt", "fieldset", "figcaption", "figure",
+  "footer", "form", "h1", "h2", "h3", "h4", "h5", "h6", "head", "header",
+  "hr", "html", "legend", "li", "main", "nav", "ol", "option", "p", "pre",
+  "section", "table", "tbody", "td", "tfoot", "th", "thead", "title", "tr",
+  "ul", NULL
+};
+
+struct entity {
+  const char *name;
+  unsigned code;
+};
+
+/* Named character references: the markup characters, Latin-1, and the
+   punctuation that mail clients actually produce. */
+static const entity entities[] = {
+  {"quot", 34}, {"amp", 38}, {"apos", 39}, {"lt", 60}, {"gt", 62},
+  {"nbsp", 160}, {"iexcl", 161}, {"cent", 162}, {"pound", 163},
+  {"curren", 164}, {"yen", 165}, {"brvbar", 166}, {"sect", 167},
+  {"uml", 168}, {"copy", 169}, {"ordf", 170}, {"laquo", 171}, {"not", 172},
+  {"shy", 173}, {"reg", 174}, {"macr", 175}, {"deg", 176}, {"plusmn", 177},
+  {"sup2", 178}, {"sup3", 179}, {"acute", 180}, {"micro", 181},
+  {"para", 182}, {"middot", 183}, {"cedil", 184}, {"sup1", 185},
+  {"ordm", 186}, {"raquo", 187}, {"frac14", 188}, {"frac12", 189},
+  {"frac34", 190}, {"iquest", 191}, {"Agrave", 192}, {"Aacute", 193},
+  {"Acirc", 194}, {"Atilde", 195}, {"Auml", 196}, {"Aring", 197},
+  {"AElig", 198}, {"Ccedil", 199}, {"Egrave", 200}, {"Eacute", 201},
+  {"Ecirc", 202}, {"Euml", 203}, {"Igrave", 204}, {"Iacute", 205},
+  {"Icirc", 206}, {"Iuml", 207}, {"ETH", 208}, {"Ntilde", 209},
+  {"Ograve", 210}, {"Oacute", 211}, {"Ocirc", 212}, {"Otilde", 213},
+  {"Ouml", 214}, {"times", 215}, {"Oslash", 216}, {"Ugrave", 217},
+  {"Uacute", 218}, {"Ucirc", 219}, {"Uuml", 220}, {"Yacute", 221},
+  {"THORN", 222}, {"szlig", 223}, {"agrave", 224}, {"aacute", 225},
+  {"acirc", 226}, {"atilde", 227}, {"auml", 228}, {"aring", 229},
+  {"aelig", 230}, {"ccedil", 231}, {"egrave", 232}, {"eacute", 233},
+  {"ecirc", 234}, {"euml", 235}, {"igrave", 236}, {"iacute", 237},
+  {"icirc", 238}, {"iuml", 239}, {"eth", 240}, {"ntilde", 241},
+  {"ograve", 242}, {"oacute", 243}, {"ocirc", 244}, {"otilde", 245},
+  {"ouml", 246}, {"divide", 247}, {"oslash", 248}, {"ugrave", 249},
+  {"uacute", 250}, {"ucirc", 251}, {"uuml", 252}, {"yacute", 253},
+  {"thorn", 254}, {"yuml", 255}, {"OElig", 338}, {"oelig", 339},
+  {"Scaron", 352}, {"scaron", 353}, {"Yuml", 376}, {"ensp", 8194},
+  {"emsp", 8195}, {"thinsp", 8201}, {"ndash", 8211}, {"mdash", 8212},
+  {"lsquo", 8216}, {"rsquo", 8217}, {"sbquo", 8218}, {"ldquo", 8220},
+  {"rdquo", 8221}, {"bdquo", 8222}, {"dagger", 8224}, {"Dagger", 8225},
+  {"bull", 8226}, {"hellip", 8230}, {"permil", 8240}, {"lsaquo", 8249},
+  {"rsaquo", 8250}, {"euro", 8364}, {"trade", 8482}, {NULL, 0}
+};
+
+static bool is_block(const char *name, size_t len)
+{
+  for (int i = 0; block_elements[i]; i++)
+    if (strlen(block_elements[i]) == len &&
+	strncasecmp(block_elements[i], name, len) == 0)
+      return true;
+  return false;
+}
+
+static size_t put_utf8(unsigned c, char *out)
+{
+  // Controls and non-characters are just a gap between words.
+  if (c < 0x20 || (c >= 0x7f && c < 0xa0) || c == 0xa0 ||
+      (c >= 0xd800 && c < 0xe000) || c > 0x10ffff) {
+    *out = ' ';
+    return 1;
+  }
+  if (c < 0x80) {
+    out[0] = c;
+    return 1;
+  }
+  if (c < 0x800) {
+    out[0] = 0xc0 | (c >> 6);
+    out[1] = 0x80 | (c & 0x3f);
+    return 2;
+  }
+  if (c < 0x10000) {
+    out[0] = 0xe0 | (c >> 12);
+    out[1] = 0x80 | ((c >> 6) & 0x3f);
+    out[2] = 0x80 | (c & 0x3f);
+    return 3;
+  }
+  out[0] = 0xf0 | (c >> 18);
+  out[1] = 0x80 | ((c >> 12) & 0x3f);
+  out[2] = 0x80 | ((c >> 6) & 0x3f);
+  out[3] = 0x80 | (c & 0x3f);
+  return 4;
+}
+
+/* Decode the character reference at p (just after the '&') to out.
+   Returns the number of bytes of input it took, or 0 if it isn't one,
+   with *written set to the bytes output, which is never more than that
+   plus one (for the '&'). */
+static size_t entity_at(const char *p, const char *end, char *out, size_t *written)
+{
+  const char *q = p;
+  unsigned c = 0;
+  if (q < end && *q == '#') {
+    q++;
+    bool hex = (q < end && (*q == 'x' || *q == 'X'));
+    if (hex) q++;
+    const char *digits = q;
+    while (q < end && (hex ? isxdigit((unsigned char)*q) : isdigit((unsigned char)*q))) {
+      if (c <= 0x10ffff)
+	c = c * (hex ? 16 : 10) +
+	  (isdigit((unsigned char)*q) ? *q - '0' : tolower((unsigned char)*q) - 'a' + 10);
+      q++;
+    }
+    if (q == digits)
+      return 0;
+  } else {
+    while (q < end && isalnum((unsigned char)*q) && q - p < 8)
+      q++;
+    size_t n = q - p;
+    int i;
+    for (i = 0; entities[i].name; i++)
+      if (strlen(entities[i].name) == n && memcmp(entities[i].name, p, n) == 0)
+	break;
+    if (entities[i].name == NULL || q == end || *q != ';')
+      return 0;
+    c = entities[i].code;
+  }
+  if (q < end && *q == ';')
+    q++;
+  *written = put_utf8(c, out);
+  return q - p;
+}
+
+/* Skip past the end of the tag whose attributes start at p, stepping over
+   quoted values, which may contain '>'. */
+static const char *tag_end(const char *p, const char *end)
+{
+  char quote = 0;
+  for ( ; p < end; p++) {
+    if (quote) {
+      if (*p == quote) quote = 0;
+    } else if (*p == '"' || *p == '\'') {
+      quote = *p;
+    } else if (*p == '>') {
+      return p + 1;
+    }
+  }
+  return end;
+}
+
+/* The end of the raw text of a <script> or <style> at p: past its
+   closing tag, or the end of the input. */
+static const char *raw_text_end(const char *p, const char *end,
+				const char *name, size_t name_len)
+{
+  for ( ; p + 2 + name_len <= end; p++) {
+    if (p[0] == '<' && p[1] == '/' && strncasecmp(p + 2, name, name_len) == 0 &&
+	(p + 2 + name_len == end || !isalnum((unsigned char)p[2 + name_len])))
+      return tag_end(p + 2 + name_len, end);
+  }
+  return end;
+}
+
+size_t html_to_text(const char *html, size_t len, char *out)
+{
+  const char *p = html;
+  const char *end = html + len;
+  char *o = out;
+
+  while (p < end) {
+    // Copy the text up to the next markup or reference in one go.
+    const char *run = p;
+    while (p < end && *p != '<' && *p != '&')
+      p++;
+    memcpy(o, run, p - run);
+    o += p - run;
+    if (p == end)
+      break;
+
+    if (*p == '&') {
+      size_t written;
+      size_t used = entity_at(p + 1, end, o, &written);
+      if (used == 0) {
+	*o++ = *p++;
+      } else {
+	o += written;
+	p += 1 + used;
+      }
+      continue;
+    }
+
+    // *p is '<'.
+    if (end - p >= 4 && memcmp(p, "<!--", 4) == 0) {
+      const char *close = NULL;
+      for (const char *q = p + 4; q + 3 <= end; q++)
+	if (q[0] == '-' && q[1] == '-' && q[2] == '>') {
+	  close = q + 3;
+	  break;
+	}
+      p = close ? close : end;
+      continue;
+    }
+    if (end - p >= 2 && (p[1] == '!' || p[1] == '?')) {
+      // <!DOCTYPE ...>, <![CDATA[...]]> and processing instructions.
+      p = tag_end(p + 2, end);
+      continue;
+    }
+    const char *name = p + 1;
+    bool closing = (name < end && *name == '/');
+    if (closing) name++;
+    if (name == end || !isalpha((unsigned char)*name)) {
+      // Not markup, like the '<' in "a < b".
+      *o++ = *p++;
+      continue;
+    }
+    const char *name_end = name;
+    while (name_end < end && isalnum((unsigned char)*name_end))
+      name_end++;
+    size_t name_len = name_end - name;
+    p = tag_end(name_end, end);
+
+    if (!closing && ((name_len == 6 && strncasecmp(name, "script", 6) == 0) ||
+		     (name_len == 5 && strncasecmp(name, "style", 5) == 0)) &&
+	p[-1] == '>' && !(p - 2 >= name_end && p[-2] == '/')) {
+      p = raw_text_end(p, end, name, name_len);
+    } else if (is_block(name, name_len)) {
+      *o++ = '\n';
+    }
+  }
+  return o - out;
+}
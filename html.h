@@ -0,0 +1,17 @@
+#ifndef HTML_H
+#define HTML_H
+
+#include <stddef.h>
+
+/* The text of an HTML document, as a reader would see it, for indexing:
+   markup, comments and the contents of <script> and <style> are dropped,
+   character references are decoded to UTF-8, and block-level elements
+   become line breaks.  Inline elements don't split words, so
+   "<b>deb</b>conf" gives "debconf".
+
+   Writes the text of the len bytes of html to out, which must have room
+   for len bytes (the text is never longer), and returns its length.  The
+   text isn't nul-terminated. */
+size_t html_to_text(const char *html, size_t len, char *out);
+
+#endif
@@ -0,0 +1,114 @@
+/* Index one message as it is delivered, for the archiver to run after
+   appending it to the list's mbox:
+
+     indexmsg [-v] [--dbname prefix] [-l language] [-n msgnum]
+              [--spam file] <list>-<year>[<month>] < message
+
+   The message is read from stdin, with or without its From_ line.  The
+   month is named as the mbox it went into; -n gives its number in that
+   mbox, and defaults to the one after the last indexed.  --spam names
+   the mbox's .spam file.  Exits 0 if the message was indexed, or needed
+   no indexing, 1 if it couldn't be, and EX_TEMPFAIL (75) if the index
+   was locked by another indexer for too long to wait. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sysexits.h>
+#include <iostream>
+#include <set>
+#include <string>
+
+#include "debindex.h"
+#include "util.h"
+using namespace std;
+
+static void usage(const char *argv0)
+{
+  cerr << "usage: " << argv0 << " [-v] [--dbname prefix] [-l language] [-n msgnum]"
+       << " [--spam file] <list>-<year>[<month>] < message" << endl;
+  exit(1);
+}
+
+int main(int argc, char** argv)
+{
+  const char *dbpathprefix = NULL;
+  const char *language = NULL;
+  const char *spamfn = NULL;
+  int msgnum = -1;
+  int argi;
+  for (argi = 1; argi < argc && argv[argi][0] == '-'; argi++) {
+    string opt(argv[argi]);
+    if (opt == "-v") {
+      verbose += 1;
+      continue;
+    }
+    if (argi + 1 >= argc)
+      usage(argv[0]);
+    if (opt == "--dbname")
+      dbpathprefix = argv[++argi];
+    else if (opt == "-l")
+      language = argv[++argi];
+    else if (opt == "-n")
+      msgnum = atoi(argv[++argi]);
+    else if (opt == "--spam")
+      spamfn = argv[++argi];
+    else
+      usage(argv[0]);
+  }
+  if (argi + 1 != argc)
+    usage(argv[0]);
+
+  string name(argv[argi]);
+  size_t dash = name.find_last_of('-');
+  string yearmonth = (dash == string::npos) ? string() : name.substr(dash + 1);
+  if (dash == 0 || (yearmonth.size() != 4 && yearmonth.size() != 6) ||
+      ! is_number(yearmonth.c_str()))
+    usage(argv[0]);
+  string list = name.substr(0, dash);
+  int year = atoi(yearmonth.substr(0, 4).c_str());
+  int month = 0;
+  if (yearmonth.size() > 4)
+    month = atoi(yearmonth.substr(4).c_str());
+
+  string message;
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+    message.append(buf, n);
+  if (ferror(stdin)) {
+    perror("reading message");
+    return 1;
+  }
+  size_t start = 0;
+  if (message.compare(0, 5, "From ") == 0) {
+    start = message.find('\n');
+    start = (start == string::npos) ? message.size() : start + 1;
+  }
+
+  set<string> spamids;
+  if (spamfn != NULL)
+    debindex_read_spamids(spamfn, spamids);
+
+  debindex_result result = debindex_init(dbpathprefix);
+  if (result == DEBINDEX_OK && language != NULL)
+    result = debindex_set_language(language);
+  if (result == DEBINDEX_OK)
+    result = debindex_message(message.data() + start, message.size() - start,
+			      list, year, month, msgnum, &spamids);
+  // Indexed but not committed is not indexed.
+  debindex_result closed = debindex_fini();
+  if (closed != DEBINDEX_OK)
+    result = closed;
+
+  static const char * const results[] = {
+    "indexed", "spam, deleted", "duplicate, skipped", "no message-id",
+    "cannot parse", "index locked, try again later", "indexing failed"
+  };
+  if (verbose > 0 || result >= DEBINDEX_NO_MSGID)
+    cerr << name << ": " << results[result] << endl;
+  if (result == DEBINDEX_LOCKED)
+    return EX_TEMPFAIL;
+  return result >= DEBINDEX_NO_MSGID ? 1 : 0;
+}
@@ -0,0 +1,196 @@
+#include "mbox.h"
+#include "metrics.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+using namespace std;
+
+// The mbox mbox_sigbus() looks after, and the page size it needs.
+static mbox * volatile live_mbox = NULL;
+static long page_size;
+
+/* The archive may shrink an mbox under us, and touching a page of the
+   mapping past the new end of the file raises SIGBUS.  Such pages of the
+   live mbox are replaced with zeros, so the read that faulted can carry
+   on, and the mbox marked as truncated for index_mbox() to notice. */
+static void mbox_sigbus(int sig, siginfo_t *info, void *)
+{
+  mbox *mb = live_mbox;
+  const char *addr = (const char *)info->si_addr;
+  if (mb != NULL && mb->map != NULL &&
+      addr >= mb->map && addr < mb->map + mb->size) {
+    char *page = (char *)mb->map + (addr - mb->map) / page_size * page_size;
+    if (mmap(page, mb->map + mb->size - page, PROT_READ,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+      mb->truncated = 1;
+      return;
+    }
+  }
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+bool mbox_open(mbox & mb, const char *fn)
+{
+  stage_timer timer(STAGE_MBOX_READ);
+  struct stat st;
+
+  if (page_size == 0) {
+    page_size = sysconf(_SC_PAGESIZE);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = mbox_sigbus;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGBUS, &sa, NULL);
+  }
+  mb.map = NULL;
+  mb.size = 0;
+  mb.truncated = 0;
+  mb.messages.clear();
+  mb.fd = open(fn, O_RDONLY);
+  if (mb.fd < 0)
+    return false;
+  if (fstat(mb.fd, &st) != 0) {
+    close(mb.fd);
+    mb.fd = -1;
+    return false;
+  }
+  mb.size = st.st_size;
+  if (mb.size == 0)
+    return true;
+
+  void *map = mmap(NULL, mb.size, PROT_READ, MAP_PRIVATE, mb.fd, 0);
+  if (map == MAP_FAILED) {
+    close(mb.fd);
+    mb.fd = -1;
+    return false;
+  }
+  // We read each message once, front to back.
+  madvise(map, mb.size, MADV_SEQUENTIAL);
+  mb.map = (const char *)map;
+  live_mbox = &mb;
+  return true;
+}
+
+/* The next "From " at the start of a line after p, or NULL.  glibc's
+   memmem is vectorised, which beats looking at every newline. */
+static const char *next_from(const char *p, const char *end)
+{
+  const void *q = memmem(p, end - p, "\nFrom ", 6);
+  return q ? (const char *)q + 1 : NULL;
+}
+
+void mbox_index(mbox & mb, long long offset)
+{
+  // Scanning the mapping is where the mbox gets read from disk.
+  stage_timer timer(STAGE_MBOX_READ);
+  mb.messages.clear();
+  if (mb.map == NULL || offset < 0 || (size_t)offset >= mb.size)
+    return;
+
+  const char *end = mb.map + mb.size;
+  const char *p = mb.map + offset;
+  // Like GMime's scan_from, skip anything before the first From_ line.
+  if (!((offset == 0 || p[-1] == '\n') &&
+        end - p >= 5 && memcmp(p, "From ", 5) == 0))
+    p = next_from(p, end);
+
+  while (p != NULL) {
+    mbox_message m;
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    const char *next = eol ? next_from(eol, end) : NULL;
+    m.from = p - mb.map;
+    m.start = eol ? eol + 1 - mb.map : mb.size;
+    m.end = next ? next - mb.map : mb.size;
+    m.slice.data = (guint8 *)mb.map + m.start;
+    m.slice.len = m.end - m.start;
+    mb.messages.push_back(m);
+    p = next;
+  }
+}
+
+void mbox_close(mbox & mb)
+{
+  if (live_mbox == &mb)
+    live_mbox = NULL;
+  if (mb.map != NULL)
+    munmap((void *)mb.map, mb.size);
+  if (mb.fd >= 0)
+    close(mb.fd);
+  mb.map = NULL;
+  mb.fd = -1;
+  mb.messages.clear();
+}
+
+GMimeStream *mbox_message_stream(mbox & mb, size_t i)
+{
+  GMimeStream *stream = g_mime_stream_mem_new();
+  // The stream doesn't own the slice, so won't try to free the mapping.
+  g_mime_stream_mem_set_byte_array(GMIME_STREAM_MEM(stream), &mb.messages[i].slice);
+  return stream;
+}
+
+GMimeMessage *mbox_parse_stream(GMimeStream *stream)
+{
+  stage_timer timer(STAGE_MIME_PARSE);
+  GMimeParser *parser = g_mime_parser_new_with_stream(stream);
+  GMimeMessage *msg = g_mime_parser_construct_message(parser);
+  g_object_unref(parser);
+  return msg;
+}
+
+GMimeMessage *mbox_parse_message(mbox & mb, size_t i)
+{
+  GMimeStream *stream = mbox_message_stream(mb, i);
+  GMimeMessage *msg = mbox_parse_stream(stream);
+  g_object_unref(stream);
+  return msg;
+}
+
+bool mbox_message_id(const mbox & mb, size_t i, string & value)
+{
+  const mbox_message & m = mb.messages[i];
+  return header_message_id(mb.map + m.start, m.end - m.start, value);
+}
+
+bool header_message_id(const char *data, size_t len, string & value)
+{
+  const char *p = data;
+  const char *end = data + len;
+
+  while (p < end) {
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    if (eol == NULL)
+      eol = end;
+    if (eol == p || (eol == p + 1 && *p == '\r'))
+      return false;  // end of the header block
+    if (eol - p >= 11 && strncasecmp(p, "Message-Id:", 11) == 0) {
+      value.assign(p + 11, eol - p - 11);
+      // Unfold continuation lines.
+      while (eol + 1 < end && (eol[1] == ' ' || eol[1] == '\t')) {
+        p = eol + 1;
+        eol = (const char *)memchr(p, '\n', end - p);
+        if (eol == NULL)
+          eol = end;
+        value.append(p, eol - p);
+      }
+      size_t l = 0, r = value.size();
+      while (l < r && isspace((unsigned char)value[l]))
+        ++l;
+      while (r > l && isspace((unsigned char)value[r - 1]))
+        --r;
+      value = value.substr(l, r - l);
+      return true;
+    }
+    p = eol + 1;
+  }
+  return false;
+}
@@ -0,0 +1,51 @@
+#ifndef MBOX_H
+#define MBOX_H
+
+#include <gmime/gmime.h>
+#include <string>
+#include <vector>
+
+/* An mbox read through a private read-only mapping.  Message boundaries
+   are found up front, so each message can be handed to GMime as a
+   memory stream over its slice of the mapping without copying it. */
+
+typedef struct {
+  long long from;   /* offset of the From_ line */
+  long long start;  /* offset of the first header line */
+  long long end;    /* offset just past the message */
+  GByteArray slice; /* start..end, for mbox_message_stream() */
+} mbox_message;
+
+typedef struct {
+  int fd;
+  const char *map;
+  size_t size;
+  std::vector<mbox_message> messages;  /* offset index, filled by mbox_index() */
+  volatile int truncated;  /* the file shrank under the mapping */
+} mbox;
+
+/* Only the mbox opened last is guarded against being truncated while it
+   is mapped: reading past the new end of the file would raise SIGBUS,
+   but instead reads zeros and sets truncated, and what was read from it
+   shouldn't be trusted. */
+bool mbox_open(mbox & mb, const char *fn);
+/* Find the messages whose From_ line is at or after offset. */
+void mbox_index(mbox & mb, long long offset);
+void mbox_close(mbox & mb);
+
+/* A stream over message i.  It refers to the mapping, so it and anything
+   parsed from it must be released before mbox_close(). */
+GMimeStream *mbox_message_stream(mbox & mb, size_t i);
+
+/* Build the full MIME tree of a message; NULL if GMime can't. */
+GMimeMessage *mbox_parse_stream(GMimeStream *stream);
+GMimeMessage *mbox_parse_message(mbox & mb, size_t i);
+
+/* The value of the first Message-Id header of message i, unfolded and
+   trimmed.  Only the header block is looked at and no MIME objects are
+   built.  Returns false if there is no such header. */
+bool mbox_message_id(const mbox & mb, size_t i, std::string & value);
+/* The same for the len bytes of a message at data, headers first. */
+bool header_message_id(const char *data, size_t len, std::string & value);
+
+#endif
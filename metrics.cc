@@ -0,0 +1,229 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <map>
+#include <sstream>
+
+using namespace std;
+
+static const char *stage_names[STAGE_COUNT] = {
+    "mbox_read",
+    "mime_parse",
+    "decode",
+    "iconv",
+    "html",
+    "termgen",
+    "replace_document",
+    "commit"
+};
+
+// Upper bounds of the per-message cost histogram, in seconds.
+static const double cost_buckets[] = {
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1
+};
+#define N_COST_BUCKETS (sizeof(cost_buckets) / sizeof(cost_buckets[0]))
+
+struct stage_stats {
+    unsigned long long calls;
+    unsigned long long wall_ns;
+    unsigned long long cpu_ns;
+};
+
+// Updated from any thread, with atomic adds.
+static stage_stats stages[STAGE_COUNT];
+static unsigned long long cost_counts[N_COST_BUCKETS + 1];
+static unsigned long long cost_sum_ns;
+
+struct list_stats {
+    unsigned long long messages;
+    unsigned long long indexed;
+    unsigned long long bytes;
+};
+
+// Only main() touches these.
+static map<string, list_stats> lists;
+static string metrics_fn;
+static bool enabled = false;
+static time_t last_write = 0;
+
+static __thread stage_timer *current_timer = NULL;
+
+static long long clock_ns(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long metrics_now(void)
+{
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+void metrics_start(const char *fn)
+{
+    metrics_fn = fn;
+    enabled = true;
+    last_write = time(NULL);
+}
+
+bool metrics_enabled(void)
+{
+    return enabled;
+}
+
+stage_timer::stage_timer(metrics_stage s)
+    : stage(s), active(enabled), parent(NULL), wall(0), cpu(0)
+{
+    if (! active)
+	return;
+    wall = clock_ns(CLOCK_MONOTONIC);
+    cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    parent = current_timer;
+    if (parent != NULL)
+	parent->charge(wall, cpu);
+    current_timer = this;
+    __sync_fetch_and_add(&stages[stage].calls, 1ULL);
+}
+
+stage_timer::~stage_timer()
+{
+    if (! active)
+	return;
+    long long now_wall = clock_ns(CLOCK_MONOTONIC);
+    long long now_cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    charge(now_wall, now_cpu);
+    current_timer = parent;
+    if (parent != NULL) {
+	parent->wall = now_wall;
+	parent->cpu = now_cpu;
+    }
+}
+
+void stage_timer::charge(long long now_wall, long long now_cpu)
+{
+    __sync_fetch_and_add(&stages[stage].wall_ns,
+			 (unsigned long long)(now_wall - wall));
+    __sync_fetch_and_add(&stages[stage].cpu_ns,
+			 (unsigned long long)(now_cpu - cpu));
+    wall = now_wall;
+    cpu = now_cpu;
+}
+
+void metrics_note_message_cost(long long ns)
+{
+    if (! enabled)
+	return;
+    size_t b = 0;
+    while (b < N_COST_BUCKETS && ns > cost_buckets[b] * 1e9)
+	++b;
+    __sync_fetch_and_add(&cost_counts[b], 1ULL);
+    __sync_fetch_and_add(&cost_sum_ns, (unsigned long long)ns);
+}
+
+void metrics_note_list(const string & list, long long bytes, bool indexed)
+{
+    if (! enabled)
+	return;
+    list_stats & l = lists[list];
+    l.messages++;
+    if (indexed)
+	l.indexed++;
+    l.bytes += bytes;
+}
+
+void metrics_maybe_write(void)
+{
+    if (enabled && time(NULL) - last_write >= METRICS_INTERVAL)
+	metrics_write();
+}
+
+static void counter(ostringstream & out, const char *name, const char *help)
+{
+    out << "# HELP debindex_" << name << ' ' << help << '\n'
+	<< "# TYPE debindex_" << name << " counter\n";
+}
+
+/* ns as seconds, to the nanosecond.  Printing ns / 1e9 would use the
+   default precision of 6 digits, going to e-notation past 999999
+   seconds, and a counter that stops growing in the file breaks rate(). */
+static void seconds(ostringstream & out, unsigned long long ns)
+{
+    char buf[48];
+    snprintf(buf, sizeof(buf), "%llu.%09llu", ns / 1000000000ULL, ns % 1000000000ULL);
+    out << buf;
+}
+
+void metrics_write(void)
+{
+    if (! enabled)
+	return;
+    last_write = time(NULL);
+
+    ostringstream out;
+    counter(out, "stage_calls_total", "Times each indexing stage ran.");
+    for (int s = 0; s < STAGE_COUNT; ++s)
+	out << "debindex_stage_calls_total{stage=\"" << stage_names[s] << "\"} "
+	    << stages[s].calls << '\n';
+    counter(out, "stage_wall_seconds_total", "Wall time in each stage.");
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+	out << "debindex_stage_wall_seconds_total{stage=\"" << stage_names[s] << "\"} ";
+	seconds(out, stages[s].wall_ns);
+	out << '\n';
+    }
+    counter(out, "stage_cpu_seconds_total", "CPU time in each stage.");
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+	out << "debindex_stage_cpu_seconds_total{stage=\"" << stage_names[s] << "\"} ";
+	seconds(out, stages[s].cpu_ns);
+	out << '\n';
+    }
+
+    counter(out, "list_messages_total", "Messages read per list.");
+    map<string, list_stats>::const_iterator i;
+    for (i = lists.begin(); i != lists.end(); ++i)
+	out << "debindex_list_messages_total{list=\"" << i->first << "\"} "
+	    << i->second.messages << '\n';
+    counter(out, "list_indexed_total", "Messages indexed per list.");
+    for (i = lists.begin(); i != lists.end(); ++i)
+	out << "debindex_list_indexed_total{list=\"" << i->first << "\"} "
+	    << i->second.indexed << '\n';
+    counter(out, "list_bytes_total", "Bytes of mbox read per list.");
+    for (i = lists.begin(); i != lists.end(); ++i)
+	out << "debindex_list_bytes_total{list=\"" << i->first << "\"} "
+	    << i->second.bytes << '\n';
+
+    out << "# HELP debindex_message_seconds Time to parse and build one message.\n"
+	<< "# TYPE debindex_message_seconds histogram\n";
+    unsigned long long cumulative = 0;
+    for (size_t b = 0; b <= N_COST_BUCKETS; ++b) {
+	cumulative += cost_counts[b];
+	out << "debindex_message_seconds_bucket{le=\"";
+	if (b < N_COST_BUCKETS)
+	    out << cost_buckets[b];
+	else
+	    out << "+Inf";
+	out << "\"} " << cumulative << '\n';
+    }
+    out << "debindex_message_seconds_sum ";
+    seconds(out, cost_sum_ns);
+    out << '\n' << "debindex_message_seconds_count " << cumulative << '\n';
+
+    // Replace the file in one go, so the collector never reads half of it.
+    string text = out.str();
+    string tmp = metrics_fn + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    bool ok = (f != NULL);
+    if (ok) {
+	ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+	ok = (fclose(f) == 0) && ok;
+    }
+    if (!ok || rename(tmp.c_str(), metrics_fn.c_str()) != 0) {
+	cerr << "Failed to write metrics to " << metrics_fn << endl;
+	unlink(tmp.c_str());
+    }
+}
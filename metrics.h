@@ -0,0 +1,54 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+
+/* With --metrics FILE, time spent in each stage of indexing and per-list
+   counts are written to FILE as a Prometheus textfile (for
+   node_exporter's textfile collector) every METRICS_INTERVAL seconds and
+   at exit.  Stage times are exclusive: a stage nested in another, such as
+   the TermGenerator inside HTML stripping, is only charged to itself. */
+
+#define METRICS_INTERVAL 60
+
+enum metrics_stage {
+  STAGE_MBOX_READ = 0,
+  STAGE_MIME_PARSE,
+  STAGE_DECODE,
+  STAGE_ICONV,
+  STAGE_HTML,
+  STAGE_TERMGEN,
+  STAGE_REPLACE,
+  STAGE_COMMIT,
+  STAGE_COUNT
+};
+
+void metrics_start(const char *fn);
+bool metrics_enabled(void);
+
+/* Charges the wall and CPU time of its scope to a stage. */
+class stage_timer {
+  public:
+    stage_timer(metrics_stage s);
+    ~stage_timer();
+
+  private:
+    metrics_stage stage;
+    bool active;
+    stage_timer *parent;
+    long long wall, cpu;	// when this stage last started or resumed
+
+    void charge(long long now_wall, long long now_cpu);
+};
+
+/* Monotonic nanoseconds, for timing a whole message. */
+long long metrics_now(void);
+/* A message taking ns nanoseconds to parse and build. */
+void metrics_note_message_cost(long long ns);
+void metrics_note_list(const std::string & list, long long bytes, bool indexed);
+
+/* Write the file if METRICS_INTERVAL has passed since it last was. */
+void metrics_maybe_write(void);
+void metrics_write(void);
+
+#endif
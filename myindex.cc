@@ -1,70 +1,554 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <iostream>
 #include <gmime/gmime.h>
 #include <string.h>
+#include <map>
 #include <set>
+#include <vector>
 #include <fstream>
+#include <errno.h>
 
 #include "tokenizer.h"
 #include "xapianglue.h"
 #include "util.h"
+#include "pipeline.h"
+#include "mbox.h"
+#include "metrics.h"
+#include "watch.h"
+#include "debindex.h"
 using namespace std;
 
-string msgid_strip(string aline)
+/* What index_mbox() did with one mbox. */
+struct mbox_counts {
+  size_t messages;		// looked at, from the checkpoint on
+  size_t indexed;
+  size_t deleted;		// as spam
+};
+
+static size_t unflushed_messages = 0;
+static size_t flush_interval = 100000;
+
+/* How long to wait for an indexmsg, which holds the index only while it
+   indexes one message, to let go of it. */
+#define MYINDEX_LOCK_WAIT 60
+
+static void flush_messages(void)
 {
-   size_t l = aline.find_first_of('<');
-   size_t r = aline.find_last_of('>');
-   if (l<r)
-     return aline.substr(l+1,r-l-1);
-   return aline;
+  if (verbose > 0)
+    cout << endl << "flushing..." << flush;
+  xapian_flush();
+  if (verbose > 0)
+    cout << " flushed" << endl;
+  unflushed_messages = 0;
 }
 
-int main(int argc, char** argv)
+/* Index the messages in mbox fn that aren't in the database yet, or all
+   of them if regenerate.  Returns false, with errno set, if fn can't be
+   read, or shrank while it was. */
+static bool index_mbox(const string & fn, bool regenerate, mbox_counts & counts)
 {
-  GMimeStream *stream;
-  GMimeParser *parser;
   GMimeMessage *msg = 0;
+  mbox mb;
+
+  counts.messages = counts.indexed = counts.deleted = 0;
+
+  // Everything parsed so far must be queued on its shard before we
+  // look at the next month's.
+  pipeline_drain();
+  if (! mbox_open(mb, fn.c_str())) {
+    int err = errno;
+    cerr << "Cannot read '" << fn << "': " << strerror(err) << endl;
+    errno = err;
+    return false;
+  }
+  string basename = fn.substr(fn.find_last_of('/')+1);
+  int lasthavemsgnum = xapian_open_db_for_month(basename, regenerate);
+  int i = basename.find_last_of('-');
+  string list = basename.substr(0,i);
+  string yearmonth = basename.substr(i+1);
+  int year = atoi(yearmonth.substr(0,4).c_str());
+  int month = 0;
+  if (yearmonth.length()>4)
+    month = atoi(yearmonth.substr(4).c_str());
+
+  cout << endl << list << " " << year << " ";
+  if (month != 0)
+    cout << month;
+  cout << endl;
+
+  set<string> spamids;
+  string spamfn = fn+".spam";
+  struct stat spamst;
+  if (stat(spamfn.c_str(), &spamst) != 0) {
+    spamst.st_size = -1;
+    spamst.st_mtime = 0;
+  }
+  debindex_read_spamids(spamfn, spamids);
+  // cout << "number spam msgids: " << spamids.size() << endl;
+  set<string> seenids;
+
+  int msgnum = 0;
+  gint64 startoffset = 0;
+
+  // Seek past what an earlier run already indexed, unless the mbox or
+  // its spam list changed underneath the checkpoint.
+  mbox_checkpoint cp;
+  if (! regenerate && lasthavemsgnum >= 0 &&
+      xapian_get_checkpoint(basename, cp)) {
+    if (cp.spamsize == (long long)spamst.st_size &&
+	cp.spammtime == spamst.st_mtime &&
+	mbox_prefix_hash(mb.fd, cp.offset) == cp.hash) {
+      startoffset = cp.offset;
+      msgnum = cp.msgnum;
+      if (verbose > 0)
+	cout << "resuming at offset " << startoffset << ", message " << msgnum << endl;
+    }
+    else if (verbose > 0)
+      cout << "checkpoint does not match, scanning whole mbox" << endl;
+  }
+  bool resumed = (startoffset != 0);
+  gint64 last_from = -1;
+  gint64 last_end = -1;
+  int last_msgnum = -1;
+
+  mbox_index(mb, startoffset);
+  size_t n = mb.messages.size();
+  counts.messages = n;
+  // The message at the checkpoint may have been caught half written, in
+  // which case it is indexed again, whole.
+  bool redo_first = resumed && n > 0 &&
+    cp.length != mb.messages[0].end - mb.messages[0].from;
+  if (redo_first && verbose > 0)
+    cout << "message " << msgnum << " has changed, reindexing it" << endl;
+  if (verbose >= 2)
+    cout << n << " messages from offset " << startoffset << endl;
+
+  /* Number the messages before indexing any.  A resumed run looks in the
+     index for the messages before the checkpoint that each repeats, and
+     nothing may be writing to the shard meanwhile. */
+  vector<string> msgids(n);
+  vector<GMimeMessage *> msgs(n, (GMimeMessage *)0);
+  vector<debindex_result> results(n, DEBINDEX_UNPARSABLE);
+  vector<int> msgnums(n);
+  for (size_t mi = 0; mi < n; ++mi) {
+    string raw_msgid;
+    msgnums[mi] = msgnum;
+    if (mbox_message_id(mb, mi, raw_msgid)) {
+      // Most messages: no need to build the MIME tree unless we index it.
+      msgids[mi] = msgid_strip(raw_msgid);
+    }
+    else {
+      msg = mbox_parse_message(mb, mi);
+      if (msg == 0) {
+	cerr << "g_mime_parser_construct_message(parser) returned NULL at offset " << mb.messages[mi].from << endl;
+	continue;
+      }
+      const char* gmime_msgid = g_mime_object_get_header(GMIME_OBJECT(msg), "Message-Id");
+      if (gmime_msgid != NULL)
+	msgids[mi] = msgid_strip(gmime_msgid);
+      else
+	msgids[mi] = fake_msgid(msg);
+      msgs[mi] = msg;
+    }
+    if (verbose >= 2)
+      cerr << endl << "msgid: " << msgids[mi] << endl;
+    results[mi] = debindex_classify(msgids[mi], &seenids, &spamids, resumed,
+				    list, year, month, msgnum);
+    if (debindex_numbered(results[mi]))
+      msgnum++;
+  }
+
+  for (size_t mi = 0; mi < n; ++mi) {
+    gint64 from_offset = mb.messages[mi].from;
+    bool indexed = false;
+    string & msgid = msgids[mi];
+    debindex_result result = results[mi];
+    msg = msgs[mi];
+    msgnum = msgnums[mi];
+    if (result == DEBINDEX_UNPARSABLE)
+      continue;
+    bool wanted = (msgnum > lasthavemsgnum) || regenerate ||
+      (mi == 0 && redo_first);
+    if (result == DEBINDEX_NO_MSGID) {
+      cerr << endl << "No msgid" << endl;
+    }
+    else if (result == DEBINDEX_DUPLICATE) {
+      if (verbose > 1)
+	cerr << endl << "dupemsgid: " << msgid << endl;
+    }
+    else if (result == DEBINDEX_SPAM) {
+      if (verbose > 1)
+	cerr << endl << "spam: " << msgid << endl;
+      if (pipeline_running())
+	pipeline_delete(msgid, list, year, month, msgnum);
+      else
+	xapian_delete_document(list, year, month, msgnum, msgid);
+      counts.deleted++;
+    }
+    else {
+      if (verbose > 2)
+	cerr << endl << "msgid: " << msgid << endl;
+      if (verbose > 0)
+	cout << "." << flush;
+      if (wanted && pipeline_running()) {
+	// The worker builds the MIME tree itself.
+	pipeline_add(mbox_message_stream(mb, mi), msgid, list, year, month, msgnum);
+	unflushed_messages++;
+	indexed = true;
+      }
+      else if (wanted) {
+	indexed = debindex_add((const char *)mb.messages[mi].slice.data,
+			       mb.messages[mi].slice.len, msg, msgid, list,
+			       year, month, msgnum);
+	if (indexed)
+	  unflushed_messages++;
+	else
+	  xapian_delete_document(list, year, month, msgnum, msgid);
+      }
+    }
+    if (debindex_numbered(result)) {
+      last_from = from_offset;
+      last_end = mb.messages[mi].end;
+      last_msgnum = msgnum;
+    }
+    if (indexed)
+      counts.indexed++;
+    metrics_note_list(list, mb.messages[mi].end - from_offset, indexed);
+    if (msg != 0)
+      g_object_unref(msg);
+  }
+
+  // Workers may still be reading messages out of the mapping.
+  pipeline_drain();
+  if (mb.truncated) {
+    // What was read past the new end was zeros; start again next time.
+    cerr << "'" << fn << "' shrank while it was being indexed" << endl;
+    mbox_close(mb);
+    errno = EIO;
+    return false;
+  }
+  if (last_from >= 0) {
+    cp.offset = last_from;
+    cp.msgnum = last_msgnum;
+    cp.length = last_end - last_from;
+    cp.hash = mbox_prefix_hash(mb.fd, last_from);
+    cp.spamsize = spamst.st_size;
+    cp.spammtime = spamst.st_mtime;
+    if (! cp.hash.empty())
+      xapian_set_checkpoint(basename, cp);
+  }
+  mbox_close(mb);
+  if (unflushed_messages>flush_interval)
+    flush_messages();
+  metrics_maybe_write();
+  return true;
+}
+
+/* Server mode (--serve): rather than taking mboxes from the command
+   line, read commands one per line, with tab-separated fields, and
+   answer each with a line:
+
+     index <mbox> [<language> [F]]	ok <mbox> <messages> <indexed> <deleted>
+					or error <mbox> <reason>
+     flush				ok flush
+     months				ok months <month>...
+     quit				ok quit
 
-  int fh;
+   F readds messages already indexed, as -F does.  months lists the
+   months already in the database, for doindex.py to send each back to
+   the process holding it.  The databases, stemmers and GMime stay open
+   between commands, so one process can index a whole run.  Commands
+   come on stdin and replies go to stdout, with everything else myindex
+   prints sent to stderr instead; or with --socket <path>, over
+   connections to a Unix socket at path, taken one at a time until a
+   quit.  The socket is created mode 0600, and takes
+   connections from the same user only. */
+
+// Returns true after a quit, false at the end of in.
+static bool serve_commands(FILE *in, FILE *out, bool regenerate)
+{
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  bool quit = false;
+  while (! quit && (len = getline(&line, &size, in)) >= 0) {
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+      line[--len] = '\0';
+    vector<string> f;
+    for (char *p = line; ; ) {
+      char *tab = strchr(p, '\t');
+      f.push_back(string(p, tab ? tab - p : strlen(p)));
+      if (tab == NULL)
+	break;
+      p = tab + 1;
+    }
+    if (f[0].empty() && f.size() == 1)
+      continue;
+
+    if (f[0] == "index" && f.size() >= 2 && f.size() <= 4) {
+      if (f.size() >= 3 && ! f[2].empty())
+	xapian_set_stemmer(f[2]);
+      mbox_counts counts;
+      if (index_mbox(f[1], regenerate || (f.size() == 4 && f[3] == "F"), counts))
+	fprintf(out, "ok\t%s\t%lu\t%lu\t%lu\n", f[1].c_str(),
+		(unsigned long)counts.messages, (unsigned long)counts.indexed,
+		(unsigned long)counts.deleted);
+      else
+	fprintf(out, "error\t%s\t%s\n", f[1].c_str(), strerror(errno));
+    }
+    else if (f[0] == "flush" && f.size() == 1) {
+      flush_messages();
+      fprintf(out, "ok\tflush\n");
+    }
+    else if (f[0] == "months" && f.size() == 1) {
+      vector<string> months;
+      xapian_list_months(months);
+      fprintf(out, "ok\tmonths");
+      for (size_t i = 0; i < months.size(); i++)
+	fprintf(out, "\t%s", months[i].c_str());
+      fprintf(out, "\n");
+    }
+    else if (f[0] == "quit" && f.size() == 1) {
+      fprintf(out, "ok\tquit\n");
+      quit = true;
+    }
+    else {
+      fprintf(out, "error\t%s\tbad command\n", f[0].c_str());
+    }
+    fflush(out);
+  }
+  free(line);
+  return quit;
+}
+
+static void serve_socket(const char *path, bool regenerate)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    cerr << "Socket path too long: " << path << endl;
+    return;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    merror("socket");
+  // Replace a socket left by an earlier run, but nothing else.
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (! S_ISSOCK(st.st_mode)) {
+      cerr << "Cannot listen on '" << path << "': not a socket" << endl;
+      close(fd);
+      return;
+    }
+    unlink(path);
+  }
+  // Only our own user may connect.
+  mode_t mask = umask(077);
+  int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (bound < 0 || listen(fd, 4) < 0) {
+    cerr << "Cannot listen on '" << path << "': " << strerror(errno) << endl;
+    close(fd);
+    return;
+  }
+  // A client going away mid-reply mustn't take the databases with it.
+  signal(SIGPIPE, SIG_IGN);
+  if (verbose > 0)
+    cout << "listening on " << path << endl;
+
+  bool quit = false;
+  while (! quit) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR)
+	continue;
+      merror("accept");
+    }
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0 ||
+	cred.uid != getuid()) {
+      if (verbose > 0)
+	cout << "refused a connection from another user" << endl;
+      close(conn);
+      continue;
+    }
+    FILE *in = fdopen(conn, "r");
+    FILE *out = fdopen(dup(conn), "w");
+    if (in == NULL || out == NULL)
+      merror("fdopen");
+    quit = serve_commands(in, out, regenerate);
+    fclose(out);
+    fclose(in);
+  }
+  close(fd);
+  unlink(path);
+}
+
+/* Watch mode (--watch <dir>): index each mbox in the archive at dir
+   as it changes, taking up only what was appended since the last
+   checkpoint, and commit within latency_ms of the change.  A burst of
+   changes is taken in one go once it has been quiet for WATCH_SETTLE_MS,
+   or half the latency has passed.  Every mbox is looked at once at the
+   start, resuming at its checkpoint, for what arrived while nothing was
+   watching.  Runs until SIGINT or SIGTERM.
+
+   With --languages <file>, holding a "<list> <language>" line for each
+   list to index, other lists are left alone; without it every list is
+   indexed with the language of -l. */
+#define WATCH_SETTLE_MS 200
+
+static map<string, string> list_languages;
+static volatile sig_atomic_t watch_stopping = 0;
+
+static void stop_watching(int)
+{
+  watch_stopping = 1;
+}
+
+static void read_list_languages(const char *fn)
+{
+  ifstream f(fn);
+  if (! f) {
+    cerr << "Cannot read '" << fn << "': " << strerror(errno) << endl;
+    return;
+  }
+  string list, language;
+  while (f >> list >> language)
+    list_languages[list] = language;
+}
+
+static void watch_archive(const char *dir, int latency_ms, bool regenerate)
+{
+  set<string> changed;
+  if (! watch_start(dir, changed)) {
+    cerr << "Cannot watch '" << dir << "': " << strerror(errno) << endl;
+    return;
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop_watching;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  long long due = metrics_now();	// when changed must be indexed by, in ns
+  while (! watch_stopping || ! changed.empty()) {
+    int timeout = -1;
+    if (! changed.empty()) {
+      long long left = (due - metrics_now()) / 1000000;
+      timeout = left < WATCH_SETTLE_MS ? (left > 0 ? left : 0) : WATCH_SETTLE_MS;
+    }
+    bool was_empty = changed.empty();
+    int events = watch_stopping ? 0 : watch_wait(timeout, changed);
+    if (changed.empty())
+      continue;
+    if (was_empty)
+      due = metrics_now() + latency_ms / 2 * 1000000LL;
+    if (events != 0 && ! watch_stopping && metrics_now() < due)
+      continue;
+
+    // Quiet for a while, or out of time.
+    size_t indexed = 0;
+    for (set<string>::iterator i = changed.begin(); i != changed.end(); ++i) {
+      string basename = i->substr(i->find_last_of('/') + 1);
+      string list = basename.substr(0, basename.find_last_of('-'));
+      if (! list_languages.empty()) {
+	map<string, string>::iterator l = list_languages.find(list);
+	if (l == list_languages.end()) {
+	  if (verbose > 1)
+	    cout << "not indexing list " << list << endl;
+	  continue;
+	}
+	xapian_set_stemmer(l->second);
+      }
+      mbox_counts counts;
+      if (index_mbox(*i, regenerate, counts))
+	indexed += counts.indexed + counts.deleted;
+    }
+    changed.clear();
+    if (indexed != 0)
+      flush_messages();
+    metrics_maybe_write();
+  }
+  watch_stop();
+}
 
-  size_t unflushed_messages = 0;
-  size_t flush_interval = 100000;
+int main(int argc, char** argv)
+{
+  unsigned long shard_docs = INDEX_CHUNK_SIZE;
+  long long shard_bytes = 0;
   bool regenerate = false;
+  const char *watch_dir = NULL;
+  int latency_ms = 5000;
   char *dbpathprefix = NULL;
+  bool serve = false;
+  const char *socket_path = NULL;
     
   int argi;
-  for (argi = 1; (argi<argc) && (strcmp(argv[argi],"-v")==0); argi++) {
-    verbose += 1;
-  }
-  if ((argi < argc) && (strcmp(argv[argi],"--dbname")==0)) {
-    ++argi;
-    if (argi < argc) {
-      dbpathprefix = argv[argi];
-      ++argi;
+  for (argi = 1; argi < argc; argi++) {
+    if (strcmp(argv[argi],"-v")==0) {
+      verbose += 1;
+    }
+    else if (strcmp(argv[argi],"--serve")==0) {
+      serve = true;
+    }
+    else if (strcmp(argv[argi],"--dbname")==0 ||
+             strcmp(argv[argi],"--socket")==0) {
+      if (argi + 1 < argc) {
+        if (argv[argi][2] == 'd')
+          dbpathprefix = argv[argi + 1];
+        else
+          socket_path = argv[argi + 1];
+        ++argi;
+      }
+      else {
+        cerr << "missing argument after " << argv[argi] << endl;
+      }
     }
     else {
-      cerr << "missing argument after --dbname" << endl;
+      break;
     }
   }
+  int reply_fd = -1;
+  if (serve && socket_path == NULL) {
+    // stdout is for replies alone.
+    reply_fd = dup(1);
+    dup2(2, 1);
+  }
 
   tokenizer_init();
+  xapian_set_lock_wait(MYINDEX_LOCK_WAIT);
   xapian_init(dbpathprefix);
+  xapian_set_commit_interval(flush_interval);
   start_time = time(NULL);
 
   // cout << argc << "  args" << endl;
-  set<string> spamids;
-  set<string> seenids;
-  
+  mbox_counts counts;
+
   enum {
     NEXT_NOTHING = 0,
     NEXT_LANG,
     NEXT_FLUSHINTERVAL,
-    NEXT_DBNAME
+    NEXT_DBNAME,
+    NEXT_JOBS,
+    NEXT_SHARDDOCS,
+    NEXT_SHARDBYTES,
+    NEXT_METRICS,
+    NEXT_QUOTED,
+    NEXT_WATCH,
+    NEXT_LATENCY,
+    NEXT_LANGUAGES
   } whatsnext = NEXT_NOTHING;
 
   // argi inited above
@@ -80,11 +564,76 @@ int main(int argc, char** argv)
     }
     else if (whatsnext == NEXT_FLUSHINTERVAL) {
       flush_interval = atoll(fn.c_str());
+      xapian_set_commit_interval(flush_interval);
       if (verbose != 0)
         cout << "flush interval: " << flush_interval << endl;
       whatsnext = NEXT_NOTHING;
       continue;
     }
+    else if (whatsnext == NEXT_JOBS) {
+      int jobs = atoi(fn.c_str());
+      if (jobs > 1 && ! pipeline_running()) {
+        pipeline_start(jobs);
+        if (verbose != 0)
+          cout << "worker threads: " << jobs << endl;
+      }
+      whatsnext = NEXT_NOTHING;
+      continue;
+    }
+    else if (whatsnext == NEXT_METRICS) {
+      metrics_start(fn.c_str());
+      if (verbose != 0)
+        cout << "metrics file: " << fn << endl;
+      whatsnext = NEXT_NOTHING;
+      continue;
+    }
+    else if (whatsnext == NEXT_QUOTED) {
+      if (fn == "skip")
+        tokenizer_set_quoted(QUOTED_SKIP);
+      else if (fn == "low")
+        tokenizer_set_quoted(QUOTED_LOW);
+      else if (fn == "index")
+        tokenizer_set_quoted(QUOTED_INDEX);
+      else {
+        cerr << "unknown --quoted mode '" << fn << "', expected index, skip or low" << endl;
+        exit(1);
+      }
+      if (verbose != 0)
+        cout << "quoted text: " << fn << endl;
+      whatsnext = NEXT_NOTHING;
+      continue;
+    }
+    else if (whatsnext == NEXT_WATCH) {
+      watch_dir = argv[argi];
+      whatsnext = NEXT_NOTHING;
+      continue;
+    }
+    else if (whatsnext == NEXT_LATENCY) {
+      latency_ms = (int)(atof(fn.c_str()) * 1000);
+      if (verbose != 0)
+        cout << "latency: " << latency_ms << " ms" << endl;
+      whatsnext = NEXT_NOTHING;
+      continue;
+    }
+    else if (whatsnext == NEXT_LANGUAGES) {
+      read_list_languages(fn.c_str());
+      if (verbose != 0)
+        cout << "languages for " << list_languages.size() << " lists" << endl;
+      whatsnext = NEXT_NOTHING;
+      continue;
+    }
+    else if (whatsnext == NEXT_SHARDDOCS || whatsnext == NEXT_SHARDBYTES) {
+      if (whatsnext == NEXT_SHARDDOCS)
+        shard_docs = strtoul(fn.c_str(), NULL, 10);
+      else
+        shard_bytes = atoll(fn.c_str());
+      xapian_set_shard_limits(shard_docs, shard_bytes);
+      if (verbose != 0)
+        cout << "shard limits: " << shard_docs << " documents, "
+             << shard_bytes << " bytes" << endl;
+      whatsnext = NEXT_NOTHING;
+      continue;
+    }
     
     if (fn == "-v") {
       verbose += 1;
@@ -98,130 +647,84 @@ int main(int argc, char** argv)
       whatsnext = NEXT_FLUSHINTERVAL;
       continue;
     }
-    if (fn == "-F") {
-      regenerate = true;
+    if (fn == "-j") {
+      whatsnext = NEXT_JOBS;
+      continue;
+    }
+    if (fn == "--shard-docs") {
+      whatsnext = NEXT_SHARDDOCS;
+      continue;
+    }
+    if (fn == "--shard-bytes") {
+      whatsnext = NEXT_SHARDBYTES;
+      continue;
+    }
+    if (fn == "--metrics") {
+      whatsnext = NEXT_METRICS;
+      continue;
+    }
+    if (fn == "--quoted") {
+      whatsnext = NEXT_QUOTED;
+      continue;
+    }
+    if (fn == "--watch") {
+      whatsnext = NEXT_WATCH;
+      continue;
+    }
+    if (fn == "--latency") {
+      whatsnext = NEXT_LATENCY;
+      continue;
+    }
+    if (fn == "--languages") {
+      whatsnext = NEXT_LANGUAGES;
+      continue;
+    }
+    if (fn == "--compact") {
+      xapian_set_compaction(true);
+      continue;
+    }
+    if (fn == "--no-body-positions") {
+      xapian_set_body_positions(false);
       if (verbose > 0)
-        cout << "readding existing documents" << endl; 
+        cout << "indexing body text without positions" << endl;
       continue;
     }
-    
-    fh = open(fn.c_str(), O_RDONLY);
-    string basename = fn.substr(fn.find_last_of('/')+1);
-    int lasthavemsgnum = xapian_open_db_for_month(basename, regenerate);
-    int i = basename.find_last_of('-');
-    string list = basename.substr(0,i);
-    string yearmonth = basename.substr(i+1);
-    int year = atoi(yearmonth.substr(0,4).c_str());
-    int month = 0;
-    if (yearmonth.length()>4)
-      month = atoi(yearmonth.substr(4).c_str());
-
-    cout << endl << list << " " << year << " ";
-    if (month != 0)
-      cout << month;
-    cout << endl;
-
-    spamids.clear();
-    string spamfn = fn+".spam";
-    ifstream spamf(spamfn.c_str());
-    if (spamf) {
-       string aline;
-       while (getline(spamf, aline)) {
-	  string::iterator i = aline.begin();
-	  while (i != aline.end() && *i != ':') {
-	     if (isalnum((unsigned char)*i) || strchr(".-+*", *i)) {
-		*i = tolower(*i);
-		i++;
-	     } else {
-		aline.erase(i);
-	     }
-	  }
-	  if (aline.substr(0,21) == "skip-spam-message-id:") {
-	    aline.erase(0,21);
-	    i = aline.begin();
-	    while (i != aline.end() && *i == ' ')
-	      aline.erase(i);
-	    spamids.insert(msgid_strip(aline));
-	  }
-       }
-    } 
-    // cout << "number spam msgids: " << spamids.size() << endl;
-     seenids.clear();
-
-    int msgnum = 0;
-    
-    stream = g_mime_stream_fs_new(fh);
-
-    parser = g_mime_parser_new_with_stream(stream);
-    g_mime_parser_set_scan_from(parser, TRUE);
-    gint64 old_pos = -1;
-    while (! g_mime_parser_eos(parser)) {
-      msg = g_mime_parser_construct_message(parser);
-      if (msg == 0) {
-	gint64 pos = g_mime_parser_tell(parser);
-	cerr << "g_mime_parser_construct_message(parser) returned NULL at offset " << pos << endl;
-	if (pos == old_pos) {
-	  cerr << "Giving up on '" << fn << "' - GMimeParser is stuck at offset " << pos << endl;
-	  break;
-	}
-	old_pos = pos;
-	continue;
-      }
-
-      const char* raw_msgid = g_mime_object_get_header(GMIME_OBJECT(msg), "Message-Id");
-      string msgid;
-      if (raw_msgid != NULL)
-	msgid = msgid_strip(raw_msgid);
-      else
-	msgid = fake_msgid(msg);
-      if (verbose >= 2)
-	cerr << endl << "msgid: " << msgid << endl;
-      if (msgid == "") {
-	cerr << endl << "No msgid" << endl;
-      }
-      else if (seenids.find(msgid) != seenids.end()) {
-	if (verbose > 1)
-	  cerr << endl << "dupemsgid: " << msgid << endl;
-      }
-      else if (spamids.find(msgid) != spamids.end()) {
-	if (verbose > 1)
-	  cerr << endl << "spam: " << msgid << endl;
-	xapian_delete_document(list, year, month, msgnum);
-	seenids.insert(msgid);
-	msgnum++;
-      }
-      else {
-	if (verbose > 2)
-	  cerr << endl << "msgid: " << msgid << endl;
-	if (verbose > 0)
-	  cout << "." << flush;
-	seenids.insert(msgid);
-	if ((msgnum > lasthavemsgnum) || regenerate) {
-	  document * doc = parse_article(msg);
-	  if (doc != NULL) {
-	    xapian_add_document(doc, msgid, list, year, month, msgnum);
-	    unflushed_messages++;
-	  }
-	}
-	msgnum++;
-      }
-      g_object_unref(msg);
+    if (fn == "-W") {
+      xapian_set_writer_threads(true);
+      continue;
     }
-     
-    g_object_unref(parser);
-    g_object_unref(stream);
-    close(fh);
-    if (unflushed_messages>flush_interval) {
+    if (fn == "--rebuild") {
+      // Implies -F, writing new copies of the shards.
+      regenerate = true;
+      xapian_set_rebuild(true);
       if (verbose > 0)
-        cout << endl << "flushing..." << flush;
-      xapian_flush();
+        cout << "rebuilding shards" << endl;
+      continue;
+    }
+    if (fn == "-F") {
+      regenerate = true;
       if (verbose > 0)
-        cout << " flushed" << endl;
-      unflushed_messages = 0;
+        cout << "readding existing documents" << endl; 
+      continue;
     }
+    
+    index_mbox(fn, regenerate, counts);
+  }
+  if (socket_path != NULL) {
+    serve_socket(socket_path, regenerate);
+  }
+  else if (serve) {
+    FILE *out = fdopen(reply_fd, "w");
+    if (out == NULL)
+      merror("fdopen");
+    serve_commands(stdin, out, regenerate);
+    fclose(out);
   }
-  if (unflushed_messages>0)
-     xapian_flush();
+  if (watch_dir != NULL)
+    watch_archive(watch_dir, latency_ms, regenerate);
+  pipeline_stop();
+  xapian_fini();
+  metrics_write();
   
   tokenizer_fini();
   if (verbose != 0)
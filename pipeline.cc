@@ -0,0 +1,224 @@
+#include "pipeline.h"
+#include "tokenizer.h"
+#include "xapianglue.h"
+#include "util.h"
+#include "mbox.h"
+#include "metrics.h"
+
+#include <xapian.h>
+#include <pthread.h>
+
+#include <deque>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+struct job {
+    unsigned long seq;
+    bool deletion;
+    GMimeStream *stream;
+    string msgid, list, language;
+    int year, month, msgnum;
+    xapian_month *target;	// where main() was when it was queued
+    Xapian::Document *xdoc;	// filled in by a worker
+    string ourxapid;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a job is queued for the workers.
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+// Signalled when a job is ready for the writer.
+static pthread_cond_t done_ready = PTHREAD_COND_INITIALIZER;
+// Signalled when the writer has written a job.
+static pthread_cond_t written = PTHREAD_COND_INITIALIZER;
+
+static deque<job *> todo;
+static map<unsigned long, job *> done;
+static unsigned long next_seq = 0;	// seq of the next job queued
+static unsigned long next_write = 0;	// seq of the next job to write
+static size_t max_in_flight = 0;
+static bool stopping = false;
+
+static vector<pthread_t> workers;
+static pthread_t writer;
+static bool running = false;
+
+static void *
+worker_main(void *)
+{
+    tokenizer_thread_init();
+    xapian_thread_init();
+    pthread_mutex_lock(&lock);
+    while (true) {
+	while (todo.empty() && !stopping)
+	    pthread_cond_wait(&work_ready, &lock);
+	if (todo.empty())
+	    break;
+	job *j = todo.front();
+	todo.pop_front();
+	pthread_mutex_unlock(&lock);
+
+	xapian_set_stemmer(j->language);
+	long long started = metrics_now();
+	// Most messages don't need a MIME tree built.
+	GByteArray *raw = g_mime_stream_mem_get_byte_array(GMIME_STREAM_MEM(j->stream));
+	GMimeMessage *msg = NULL;
+	document *d = parse_simple_article((const char *)raw->data, raw->len);
+	if (d == NULL) {
+	    msg = mbox_parse_stream(j->stream);
+	    d = parse_article(msg);
+	}
+	g_object_unref(j->stream);
+	j->stream = NULL;
+	if (d != NULL)
+	    j->xdoc = xapian_build_document(d, j->msgid, j->list,
+					    j->year, j->month, j->msgnum,
+					    j->ourxapid);
+	if (msg != NULL)
+	    g_object_unref(msg);
+	metrics_note_message_cost(metrics_now() - started);
+
+	pthread_mutex_lock(&lock);
+	done[j->seq] = j;
+	pthread_cond_signal(&done_ready);
+    }
+    pthread_mutex_unlock(&lock);
+    xapian_thread_fini();
+    tokenizer_thread_fini();
+    return NULL;
+}
+
+static void *
+writer_main(void *)
+{
+    pthread_mutex_lock(&lock);
+    while (true) {
+	map<unsigned long, job *>::iterator i;
+	while ((i = done.find(next_write)) == done.end() &&
+	       !(stopping && next_write == next_seq))
+	    pthread_cond_wait(&done_ready, &lock);
+	if (i == done.end())
+	    break;
+	job *j = i->second;
+	done.erase(i);
+	pthread_mutex_unlock(&lock);
+
+	if (j->xdoc != NULL) {
+	    xapian_write_document(j->target, j->ourxapid, j->msgnum, j->xdoc);
+	} else {
+	    // Spam, or a message that couldn't be parsed: either way it
+	    // keeps its msgnum.
+	    xapian_delete_document(j->target, j->list, j->year, j->month, j->msgnum, j->msgid);
+	}
+	delete j;
+
+	pthread_mutex_lock(&lock);
+	++next_write;
+	pthread_cond_broadcast(&written);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static void
+submit(job *j)
+{
+    pthread_mutex_lock(&lock);
+    while (next_seq - next_write >= max_in_flight)
+	pthread_cond_wait(&written, &lock);
+    j->seq = next_seq++;
+    if (!j->deletion) {
+	todo.push_back(j);
+	pthread_cond_signal(&work_ready);
+    } else {
+	// Nothing for a worker to do.
+	done[j->seq] = j;
+	pthread_cond_signal(&done_ready);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void
+pipeline_start(int nworkers)
+{
+    if (running || nworkers < 1)
+	return;
+    max_in_flight = nworkers * PIPELINE_DEPTH_PER_WORKER;
+    stopping = false;
+    workers.resize(nworkers);
+    for (int i = 0; i < nworkers; ++i) {
+	if (pthread_create(&workers[i], NULL, worker_main, NULL) != 0)
+	    merror("pthread_create");
+    }
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0)
+	merror("pthread_create");
+    running = true;
+}
+
+void
+pipeline_stop(void)
+{
+    if (!running)
+	return;
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&work_ready);
+    pthread_cond_broadcast(&done_ready);
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; i < workers.size(); ++i)
+	pthread_join(workers[i], NULL);
+    pthread_join(writer, NULL);
+    workers.clear();
+    running = false;
+}
+
+bool
+pipeline_running(void)
+{
+    return running;
+}
+
+void
+pipeline_add(GMimeStream *stream, const string & msgid, const string & list, int year, int month, int msgnum)
+{
+    job *j = new job;
+    j->deletion = false;
+    j->stream = stream;
+    j->msgid = msgid;
+    j->list = list;
+    j->language = xapian_get_language();
+    j->year = year;
+    j->month = month;
+    j->msgnum = msgnum;
+    j->target = xapian_current_month();
+    j->xdoc = NULL;
+    submit(j);
+}
+
+void
+pipeline_delete(const string & msgid, const string & list, int year, int month, int msgnum)
+{
+    job *j = new job;
+    j->deletion = true;
+    j->stream = NULL;
+    j->msgid = msgid;
+    j->list = list;
+    j->year = year;
+    j->month = month;
+    j->msgnum = msgnum;
+    j->target = xapian_current_month();
+    j->xdoc = NULL;
+    submit(j);
+}
+
+void
+pipeline_drain(void)
+{
+    if (!running)
+	return;
+    pthread_mutex_lock(&lock);
+    while (next_write != next_seq)
+	pthread_cond_wait(&written, &lock);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,31 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <gmime/gmime.h>
+#include <string>
+
+/* With -j N, MIME parsing, parse_article() and building the Xapian
+   document run in N worker threads, each with its own parse state,
+   TermGenerator and stemmer.  A single writer thread applies the results to the database
+   in the order they were queued, so msgnums and deletions come out just
+   as in the single-threaded path.
+
+   Anything else touching the database (opening another month, reading
+   terms or metadata, flushing) must call pipeline_drain() first. */
+
+/* How many messages may be queued or in flight per worker. */
+#define PIPELINE_DEPTH_PER_WORKER 4
+
+void pipeline_start(int nworkers);
+void pipeline_stop(void);
+bool pipeline_running(void);
+
+/* Takes over the caller's reference to stream, which holds one message
+   for a worker to parse. */
+void pipeline_add(GMimeStream *stream, const std::string & msgid, const std::string & list, int year, int month, int msgnum);
+void pipeline_delete(const std::string & msgid, const std::string & list, int year, int month, int msgnum);
+
+/* Wait until everything queued so far has been written. */
+void pipeline_drain(void);
+
+#endif
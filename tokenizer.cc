@@ -25,12 +25,20 @@
 #include "tokenizer.h"
 #include "xapianglue.h"
 #include "util.h"
+#include "metrics.h"
+#include "decode.h"
+#include "html.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
+#include <iconv.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <iostream>
 
 #include <map>
@@ -54,17 +62,139 @@ static set<string> groups;
 // FIXME:
 // Need to scan gmane.conf and find the line ":groupname:", then look for
 // :charset=([^:]*) and set default_charset to $1 if found.
-static const char * default_charset = NULL;
+static __thread const char * default_charset = NULL;
+
+/* Parse state is per thread, so that pipeline workers can run
+   parse_article() concurrently.  Threads which haven't called
+   tokenizer_thread_init() share main_state.  The strings used for
+   working on the From: header are kept, so once they've grown, parsing
+   a message doesn't allocate for them. */
+struct parse_state {
+  document doc;
+  string name, author, pre;
+};
+static parse_state main_state;
+static __thread parse_state *thread_state = NULL;
+static __thread int tallied_length;
+static __thread bool message_truncated;
+/* How many messages deep in message/rfc822 parts and digests we are. */
+static __thread int embedded_depth = 0;
+
+static __thread int doc_body_length = 0;
+
+static inline parse_state & cur_state(void) {
+  return thread_state ? *thread_state : main_state;
+}
+
+static inline document & cur_doc(void) {
+  return cur_state().doc;
+}
+
+/* Buffers reused from part to part, so decoding a part doesn't allocate.
+   Anything bigger than SCRATCH_KEEP_BYTES is given back once the part is
+   done with, rather than held by the thread for good. */
+#define SCRATCH_KEEP_BYTES (1024 * 1024)
+
+typedef struct scratch {
+  char *data;
+  size_t size;
+} scratch;
+
+static __thread scratch raw_scratch, decode_scratch, text_scratch;
+
+/* Make room for n bytes in s, keeping what's there. */
+static char *scratch_space(scratch & s, size_t n) {
+  if (n > s.size) {
+    s.size = n > 2 * s.size ? n : 2 * s.size;
+    s.data = (char *)realloc(s.data, s.size);
+    if (s.data == NULL)
+      merror("realloc");
+  }
+  return s.data;
+}
+
+static void free_scratch(scratch & s) {
+  free(s.data);
+  s.data = NULL;
+  s.size = 0;
+}
+
+static void release_scratch(void) {
+  if (raw_scratch.size > SCRATCH_KEEP_BYTES) free_scratch(raw_scratch);
+  if (decode_scratch.size > SCRATCH_KEEP_BYTES) free_scratch(decode_scratch);
+  if (text_scratch.size > SCRATCH_KEEP_BYTES) free_scratch(text_scratch);
+}
+
+/* Our own temporaries for one message, all freed at once by
+   arena_reset() when the next message starts.  If a message needs more
+   than one block, the next gets a single block the size of them all (up
+   to SCRATCH_KEEP_BYTES), so the arena settles to one block and no
+   malloc(). */
+#define ARENA_BLOCK_SIZE 4096
+
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t size, used;
+} arena_block;
+
+static __thread arena_block *arena = NULL;
+
+static arena_block *new_arena_block(size_t size, arena_block *next) {
+  arena_block *b = (arena_block *)malloc(sizeof(arena_block) + size);
+  if (b == NULL)
+    merror("malloc");
+  b->next = next;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+static char *arena_alloc(size_t n) {
+  n = (n + 7) & ~(size_t)7;
+  if (arena == NULL || arena->size - arena->used < n) {
+    size_t size = arena ? 2 * arena->size : ARENA_BLOCK_SIZE;
+    arena = new_arena_block(n > size ? n : size, arena);
+  }
+  char *p = (char *)(arena + 1) + arena->used;
+  arena->used += n;
+  return p;
+}
+
+static char *arena_strndup(const char *s, size_t n) {
+  char *copy = arena_alloc(n + 1);
+  memcpy(copy, s, n);
+  copy[n] = '\0';
+  return copy;
+}
 
-static document doc;
-static int tallied_length;
+static void free_arena(void) {
+  while (arena != NULL) {
+    arena_block *next = arena->next;
+    free(arena);
+    arena = next;
+  }
+}
 
-static int doc_body_length = 0;
+static void arena_reset(void) {
+  if (arena == NULL)
+    return;
+  if (arena->next != NULL) {
+    size_t total = 0;
+    for (arena_block *b = arena; b != NULL; b = b->next)
+      total += b->size;
+    free_arena();
+    if (total > SCRATCH_KEEP_BYTES)
+      total = SCRATCH_KEEP_BYTES;
+    arena = new_arena_block(total, NULL);
+  }
+  arena->used = 0;
+}
 
 /* Save some text from the body of a message.  The idea here is that
    we ignore all lines that start with ">" to avoid saving bits of
    quoted text. */
 static void save_body_bits(const char *text, int start, int end) {
+  document & doc = cur_doc();
   char c;
   int i;
   int nl = 1;
@@ -114,18 +244,83 @@ static void save_body_bits(const char *text, int start, int end) {
   }
 }
 
-static void tally(const char* itext, int start, int end) {
-  if ((tallied_length + end - start) >= MAX_MESSAGE_SIZE) {
-    fprintf(stderr, "Max message size reached.\n");
+/* How many more bytes of this message's text can be indexed before
+   MAX_MESSAGE_SIZE is reached. */
+static size_t text_budget(void) {
+  if (tallied_length >= MAX_MESSAGE_SIZE - 1) return 0;
+  return MAX_MESSAGE_SIZE - 1 - tallied_length;
+}
+
+/* The length of text cut to at most max bytes: at a space if there's one
+   near the end, so no word is cut short, otherwise at a UTF-8 character
+   boundary. */
+static size_t cut_text(const char *text, size_t max) {
+  for (size_t n = max; n > 0 && max - n < 64; n--)
+    if (isspace((unsigned char)text[n])) return n;
+  while (max > 0 && ((unsigned char)text[max] & 0xc0) == 0x80) max--;
+  return max;
+}
+
+/* How much of len bytes of text can be indexed within the budget,
+   warning the first time some of a message's text can't. */
+static size_t within_budget(const char *text, size_t len) {
+  size_t budget = text_budget();
+  if (len > budget) {
+    if (! message_truncated)
+      fprintf(stderr, "Max message size reached.\n");
     // TV-COMMENT: should print msgid
-    return;
+    message_truncated = true;
+    len = cut_text(text, budget);
+  }
+  return len;
+}
+
+static void tally(const char* itext, int start, int end) {
+  size_t len = within_budget(itext + start, end - start);
+  if (len == 0) return;
+  xapian_tokenise(NULL, itext + start, len);
+  tallied_length += len;
+}
+
+static quoted_mode quoted = QUOTED_INDEX;
+
+void tokenizer_set_quoted(quoted_mode mode) {
+  quoted = mode;
+  xapian_set_quoted(mode);
+}
+
+static void tally_region(const char *text, int start, int end, bool is_quote) {
+  if (! is_quote) {
+    tally(text, start, end);
+  } else if (quoted == QUOTED_LOW) {
+    size_t len = within_budget(text + start, end - start);
+    if (len == 0) return;
+    xapian_index_field(FIELD_QUOTED, text + start, len);
+    tallied_length += len;
   }
-  xapian_tokenise(NULL, itext + start, end - start);
-  tallied_length += end - start;
 }
 
-static void tally_string(const char *string) {
-  tally(string, 0, strlen(string));
+/* tally() for a plain text body, with its quoted lines indexed as the
+   quoted mode says.  Each run of quoted or unquoted lines goes to the
+   TermGenerator in one go. */
+static void tally_plain(const char *text, int start, int end) {
+  if (quoted == QUOTED_INDEX) {
+    tally(text, start, end);
+    return;
+  }
+  int run = start;
+  bool in_quote = (start < end && text[start] == '>');
+  for (int i = start; i < end; ) {
+    bool is_quote = (text[i] == '>');
+    if (is_quote != in_quote) {
+      tally_region(text, run, i, in_quote);
+      run = i;
+      in_quote = is_quote;
+    }
+    const char *nl = (const char *)memchr(text + i, '\n', end - i);
+    i = nl ? nl - text + 1 : end;
+  }
+  tally_region(text, run, end, in_quote);
 }
 
 static void transform_text_plain(const char *content) {
@@ -138,70 +333,283 @@ static void transform_text_plain(const char *content) {
       if (s != NULL) content = s + 2;
       /* Now remove the trailer. */
       if ((s = strstr(content, "-----BEGIN PGP SIGNATURE-----")) != NULL) {
-	  tally(content, 0, s - content);
+	  tally_plain(content, 0, s - content);
 	  save_body_bits(content, 0, s - content);
 	  return;
       }
   }
-  tally_string(content);
-  save_body_bits(content, 0, strlen(content));
+  size_t len = strlen(content);
+  tally_plain(content, 0, len);
+  save_body_bits(content, 0, len);
 }
 
 static void transform_text_html(const char *content) {
   if (content == NULL) return;
-  gchar curChar = 0;
-  size_t beg = 0;
-  size_t contentLen = strlen(content);
-  size_t i;
-  // FIXME : parse HTML better - entities are the main issue, but
-  // also not all tags count as space!
-  for (i=0; i<contentLen; ++i) {
-    curChar = content[i];
-
-    if (curChar == '<') {
-      if (i != beg) {
-	tally(content, beg, i);
-	save_body_bits(content, beg, i);
-	beg = i+1;
-      }
-    }
-
-    if (curChar == '>') 
-      beg = i+1;
-  }
-  if (i != beg) {
-    tally(content, beg, i);
-    save_body_bits(content, beg, i);
+  size_t len = strlen(content);
+  char *text = scratch_space(text_scratch, len);
+  {
+    stage_timer timer(STAGE_HTML);
+    len = html_to_text(content, len, text);
   }
+  // All the text at once, so the TermGenerator runs just once.
+  tally(text, 0, len);
+  save_body_bits(text, 0, len);
 }
 
-static void transform_message_rfc822(const char *content);
+typedef void (*transform_fn)(const char *);
 
 typedef struct transform {
   const char *content_type;
-  void (*function)(const char *);
+  transform_fn function;
 } transform;
 
 static struct transform part_transforms[] = {
   {"text/plain", transform_text_plain},
   {"text/html", transform_text_html},
-  {"message/rfc822", transform_message_rfc822},
   {NULL, NULL}};
 
-static char *convert_to_utf8(const char *string, size_t len, const char *charset) {
-  const char *utf8, *local;
-  iconv_t local_to_utf8;
-  char *result;
+/* Converters to UTF-8 by iconv name, kept per thread as iconv_t isn't
+   thread safe.  A charset iconv doesn't know is cached as (iconv_t)-1. */
+typedef map<string, iconv_t> converter_cache;
+static __thread converter_cache *converters = NULL;
+
+/* UTF-8 for bytes 0x80-0xff read as Latin-1; see tokenizer_init(). */
+static char latin1_utf8[128][2];
+
+static void free_converters(void) {
+  if (converters == NULL) return;
+  for (converter_cache::iterator i = converters->begin();
+       i != converters->end(); ++i)
+    if (i->second != (iconv_t)-1)
+      iconv_close(i->second);
+  delete converters;
+  converters = NULL;
+}
+
+static iconv_t get_converter(const char *local) {
+  if (converters == NULL)
+    converters = new converter_cache;
+  converter_cache::iterator i = converters->find(local);
+  if (i != converters->end())
+    return i->second;
+  iconv_t cd = iconv_open(g_mime_charset_iconv_name("utf-8"), local);
+  (*converters)[local] = cd;
+  return cd;
+}
+
+/* The number of 7-bit bytes at the start of s. */
+static size_t ascii_run(const char *s, size_t len) {
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16) {
+    int high = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+    if (high != 0)
+      return i + __builtin_ctz(high);
+  }
+#endif
+  while (i < len && !(s[i] & 0x80))
+    i++;
+  return i;
+}
 
-  utf8 = g_mime_charset_iconv_name("utf-8");
-  local = g_mime_charset_iconv_name(charset);
-  local_to_utf8 = g_mime_iconv_open(utf8, local);
-  result = g_mime_iconv_strndup(local_to_utf8, string, len);
-  g_mime_iconv_close(local_to_utf8);
+/* The length of the well-formed UTF-8 sequence at p, or 0. */
+static size_t utf8_sequence(const unsigned char *p, size_t left) {
+  unsigned char c = p[0];
+  size_t n;
+  unsigned min;
+  unsigned cp;
+  if (c < 0x80) return 1;
+  if (c < 0xc2) return 0;
+  if (c < 0xe0) { n = 2; min = 0x80; cp = c & 0x1f; }
+  else if (c < 0xf0) { n = 3; min = 0x800; cp = c & 0x0f; }
+  else if (c < 0xf5) { n = 4; min = 0x10000; cp = c & 0x07; }
+  else return 0;
+  if (left < n) return 0;
+  for (size_t k = 1; k < n; k++) {
+    if ((p[k] & 0xc0) != 0x80) return 0;
+    cp = (cp << 6) | (p[k] & 0x3f);
+  }
+  if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+    return 0;
+  return n;
+}
 
+/* Copy s to a malloc()ed string, reading its non-ASCII bytes as Latin-1
+   except, with keep_utf8, where they form well-formed UTF-8. */
+static char *widen_latin1(const char *s, size_t len, bool keep_utf8) {
+  char *result = (char *)malloc(2 * len + 1);
+  char *out = result;
+  size_t i = 0;
+  while (i < len) {
+    size_t n = ascii_run(s + i, len - i);
+    memcpy(out, s + i, n);
+    out += n;
+    i += n;
+    if (i == len) break;
+    if (keep_utf8 && (n = utf8_sequence((const unsigned char *)s + i, len - i))) {
+      memcpy(out, s + i, n);
+      out += n;
+      i += n;
+    } else {
+      const char *w = latin1_utf8[(unsigned char)s[i++] - 0x80];
+      *out++ = w[0];
+      *out++ = w[1];
+    }
+  }
+  *out = '\0';
   return result;
 }
 
+/* Whether the 7-bit bytes of text in this charset are always ASCII. */
+static bool ascii_compatible(const char *local) {
+  return strncasecmp(local, "utf-7", 5) != 0 &&
+    strncasecmp(local, "utf-16", 6) != 0 &&
+    strncasecmp(local, "utf-32", 6) != 0 &&
+    strncasecmp(local, "ucs", 3) != 0 &&
+    strncasecmp(local, "hz", 2) != 0 &&
+    strstr(local, "2022") == NULL;
+}
+
+static bool is_utf8(const char *local) {
+  return strcasecmp(local, "utf-8") == 0 || strcasecmp(local, "utf8") == 0;
+}
+
+/* Returns a malloc()ed UTF-8 copy of string, or NULL if string can be
+   used as it is or can't be converted.  Most of the archive is ASCII or
+   Latin-1, which never need iconv. */
+static char *convert_to_utf8(const char *string, size_t len, const char *charset) {
+  stage_timer timer(STAGE_ICONV);
+  const char *local = g_mime_charset_iconv_name(charset);
+  size_t ascii = ascii_run(string, len);
+
+  if (ascii == len && ascii_compatible(local))
+    return NULL;
+  if (is_utf8(local)) {
+    for (size_t i = ascii; i < len; ) {
+      size_t n = utf8_sequence((const unsigned char *)string + i, len - i);
+      if (n == 0) {
+        /* Mislabelled.  Read the stray bytes as Latin-1, as the
+           TermGenerator would, so the stored text is UTF-8 too. */
+        return widen_latin1(string, len, true);
+      }
+      i += n;
+      i += ascii_run(string + i, len - i);
+    }
+    return NULL;
+  }
+  if (strcasecmp(local, "iso-8859-1") == 0 || strcasecmp(local, "latin1") == 0)
+    return widen_latin1(string, len, false);
+
+  iconv_t local_to_utf8 = get_converter(local);
+  if (local_to_utf8 == (iconv_t)-1)
+    return NULL;
+  // Back to the initial shift state, whatever the last use left.
+  iconv(local_to_utf8, NULL, NULL, NULL, NULL);
+  return g_mime_iconv_strndup(local_to_utf8, string, len);
+}
+
+/* The undecoded content of a part.  The parser gives us a memory stream
+   over the message, so this is normally the bytes of the mbox itself;
+   any other stream is read into raw_scratch. */
+static const char *raw_content(GMimeStream *stream, size_t & len) {
+  if (GMIME_IS_STREAM_MEM(stream)) {
+    GByteArray *buf = g_mime_stream_mem_get_byte_array(GMIME_STREAM_MEM(stream));
+    gint64 start = stream->bound_start;
+    gint64 end = stream->bound_end;
+    if (end < 0 || end > (gint64)buf->len)
+      end = buf->len;
+    if (start > end)
+      start = end;
+    len = end - start;
+    return (const char *)buf->data + start;
+  }
+  len = 0;
+  if (g_mime_stream_reset(stream) < 0)
+    return NULL;
+  while (true) {
+    char *buf = scratch_space(raw_scratch, len + 8192);
+    ssize_t n = g_mime_stream_read(stream, buf + len, raw_scratch.size - len);
+    if (n < 0)
+      return NULL;
+    if (n == 0)
+      break;
+    len += n;
+  }
+  return raw_scratch.data;
+}
+
+/* Decode raw content in encoding, which mustn't be uuencode, into
+   decode_scratch, nul-terminated, setting len to its length.  No more is
+   decoded than is left of the message's budget (see text_budget()); text
+   cut short there is cut back to whole characters if charset is UTF-8.
+   The result is only good until the next part is decoded. */
+static char *decode_raw(GMimeContentEncoding encoding, const char *charset,
+			const char *raw, size_t raw_len, size_t & len) {
+  stage_timer timer(STAGE_DECODE);
+  size_t max = text_budget();
+  size_t room;
+  char *out;
+  if (encoding == GMIME_CONTENT_ENCODING_BASE64) {
+    room = BASE64_DECODED_MAX(raw_len);
+    room = room < max ? room : max;
+    out = scratch_space(decode_scratch, room + 1);
+    len = base64_decode(raw, raw_len, out, room);
+  } else if (encoding == GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE) {
+    room = raw_len < max ? raw_len : max;
+    out = scratch_space(decode_scratch, room + 1);
+    len = qp_decode(raw, raw_len, out, room);
+  } else {
+    room = raw_len < max ? raw_len : max;
+    out = scratch_space(decode_scratch, room + 1);
+    memcpy(out, raw, room);
+    len = room;
+  }
+  if (len == max && max > 0 && is_utf8(g_mime_charset_iconv_name(charset))) {
+    // Drop a character the budget cut in two.
+    size_t start = len;
+    while (start > 0 && len - start < 4 && ((unsigned char)out[start - 1] & 0xc0) == 0x80)
+      start--;
+    if (start > 0 && utf8_sequence((const unsigned char *)out + start - 1,
+				   len - start + 1) == 0)
+      len = start - 1;
+  }
+  out[len] = '\0';
+  return out;
+}
+
+/* decode_raw() for the content of a part, or NULL if it can't be read. */
+static char *decode_content(GMimeDataWrapper *data, const char *charset,
+			    size_t & len) {
+  GMimeContentEncoding encoding = g_mime_data_wrapper_get_encoding(data);
+  size_t raw_len;
+  const char *raw;
+  if (encoding == GMIME_CONTENT_ENCODING_UUENCODE) {
+    // Rare enough to leave to GMime.
+    GMimeStream *stream = g_mime_stream_mem_new();
+    {
+      stage_timer timer(STAGE_DECODE);
+      if (g_mime_data_wrapper_write_to_stream(data, stream) < 0) {
+	g_object_unref(stream);
+	return NULL;
+      }
+    }
+    GByteArray *buf = g_mime_stream_mem_get_byte_array(GMIME_STREAM_MEM(stream));
+    char *out = decode_raw(GMIME_CONTENT_ENCODING_BINARY, charset,
+			   (const char *)buf->data, buf->len, len);
+    g_object_unref(stream);
+    return out;
+  }
+  {
+    stage_timer timer(STAGE_DECODE);
+    raw = raw_content(g_mime_data_wrapper_get_stream(data), raw_len);
+  }
+  if (raw == NULL)
+    return NULL;
+  return decode_raw(encoding, charset, raw, raw_len, len);
+}
+
+static void transform_embedded_message(GMimePart *part);
+
 static void transform_simple_part(GMimePart* part) {
 //    fprintf(stderr, "transform_simple_part\n");
   GMimeContentType* ct = 0;
@@ -230,46 +638,38 @@ static void transform_simple_part(GMimePart* part) {
   for (p = content_type; *p; p++) 
     *p = tolower(*p);
 
-  GMimeStream * out = g_mime_stream_mem_new();
-  GMimeDataWrapper * data = g_mime_part_get_content_object(part);
-  if (g_mime_data_wrapper_write_to_stream(data, out) < 0) {
-    /* FIXME: How best to handle? */
-    g_object_unref(out);
-    g_object_unref(data);
+  if (! strcmp(content_type, "message/rfc822")) {
+    transform_embedded_message(part);
     return;
   }
 
-  GByteArray * byte_array = g_mime_stream_mem_get_byte_array((GMimeStreamMem*)out);
-  char * ccontent = (char*)byte_array->data;
+  // Parts we don't index aren't decoded at all.
+  transform_fn function = NULL;
+  for (i = 0; (part_type = part_transforms[i].content_type) != NULL; i++) {
+    if (! strcmp(part_type, content_type)) {
+      function = part_transforms[i].function;
+      break;
+    }
+  }
+  // Nor are parts past the message's budget.
+  if (function == NULL || text_budget() == 0)
+    return;
+
+  GMimeDataWrapper * data = g_mime_part_get_content_object(part);
+  size_t len;
+  char * ccontent = decode_content(data, charset, len);
+  if (ccontent == NULL)
+    return;
 
   /* Convert contents to utf-8.  If the contents are already
    * utf-8 or the conversion wasn't successful, we use the
    * original contents. */
-  if (strcmp(charset, "utf-8") != 0) {
-    use_content = convert_to_utf8(ccontent, byte_array->len, charset);
-  }
-
-  if (use_content == NULL) {
-    // Nul-terminate.
-    g_mime_stream_write(out, "", 1);
-    use_content = ccontent;
-  }
+  use_content = convert_to_utf8(ccontent, len, charset);
 
-  for (i = 0; ; i++) {
-    if ((part_type = part_transforms[i].content_type) == NULL) {
-      if (0 && strncmp(content_type, "text/", 5)) {
-	transform_text_plain(use_content);
-      }
-      break;
-    } else if (! strcmp(part_type, content_type)) {
-      (part_transforms[i].function)(use_content);
-      break;
-    }
-  }
+  function(use_content ? use_content : ccontent);
 
-  if (use_content != ccontent)
-    free(use_content);
-  g_object_unref(out);
+  free(use_content);
+  release_scratch();
 }
 
 static void transform_part(GMimeObject *mime_part);
@@ -327,24 +727,20 @@ transform_multipart(GMimeMultipart *mime_part, const GMimeContentType * ct) {
     transform_part(preferred);
 
   } else if (! strcmp(subtype, "digest")) {
-    /* multipart/digest message. */
-    GMimeContentType * ct;
+    /* multipart/digest message.  Its parts are messages, whatever they
+       say they are. */
     int num_subparts = g_mime_multipart_get_count(mime_part);
-    for (int i = 0; i < num_subparts; ++i) {
+    for (int i = 0; i < num_subparts && text_budget() > 0; ++i) {
       GMimeObject * child = g_mime_multipart_get_part(mime_part, i);
-      if (GMIME_IS_PART(child)) {
-//	  fprintf(stderr, "digest part\n");
-	ct = g_mime_content_type_new("message", "rfc822");
-	g_mime_object_set_content_type(GMIME_OBJECT(child), ct);
+      if (GMIME_IS_PART(child))
+	transform_embedded_message(GMIME_PART(child));
+      else
 	transform_part(child);
-      } else {
-//	  fprintf(stderr, "multipart/digest subpart isn't a GMimePart?!\n");
-      }
     }
   } else {
     /* Multipart mixed and related. */
     int num_subparts = g_mime_multipart_get_count(mime_part);
-    for (int i = 0; i < num_subparts; ++i) {
+    for (int i = 0; i < num_subparts && text_budget() > 0; ++i) {
       GMimeObject * child = g_mime_multipart_get_part(mime_part, i);
       transform_part(child);
     }
@@ -362,25 +758,69 @@ static void transform_part(GMimeObject *mime_part) {
   } else if (GMIME_IS_MESSAGE_PART(mime_part)) {
     GMimeMessagePart * msgpart = GMIME_MESSAGE_PART(mime_part);
     GMimeMessage * msg = g_mime_message_part_get_message(msgpart);
-    transform_part(msg->mime_part);
+    if (msg != NULL && embedded_depth < MAX_EMBEDDED_DEPTH) {
+      embedded_depth++;
+      transform_part(msg->mime_part);
+      embedded_depth--;
+    }
   } else if (mime_part != NULL) {
     fprintf(stderr, "part is type %s\n", g_type_name(G_TYPE_FROM_INSTANCE(mime_part)));
   }
 }
 
-static void transform_message_rfc822(const char *content) {
-  if (content == NULL) return;
+/* Index a part holding a message which GMime left unparsed: a part of a
+   digest, or a message/rfc822 part it didn't parse as one.  Unless the
+   part has a transfer encoding, the message is parsed in place, from a
+   substream of the part's own stream (normally a view of the mbox
+   mapping), and only its first MAX_EMBEDDED_SIZE bytes. */
+static void transform_embedded_message(GMimePart *part) {
+  if (embedded_depth >= MAX_EMBEDDED_DEPTH || text_budget() == 0)
+    return;
+  GMimeDataWrapper *data = g_mime_part_get_content_object(part);
+  if (data == NULL)
+    return;
+
   GMimeStream *stream;
-  GMimeParser *parser;
+  switch (g_mime_data_wrapper_get_encoding(data)) {
+    case GMIME_CONTENT_ENCODING_BASE64:
+    case GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE:
+    case GMIME_CONTENT_ENCODING_UUENCODE: {
+      /* Rare.  The decoded message has to be copied, as decoding its
+	 own parts reuses the buffer. */
+      size_t len;
+      char *decoded = decode_content(data, default_charset, len);
+      if (decoded == NULL)
+	return;
+      if (len > MAX_EMBEDDED_SIZE)
+	len = MAX_EMBEDDED_SIZE;
+      stream = g_mime_stream_mem_new_with_buffer(decoded, len);
+      break;
+    }
+    default: {
+      GMimeStream *content = g_mime_data_wrapper_get_stream(data);
+      gint64 len = g_mime_stream_length(content);
+      if (len < 0)
+	return;
+      if (len > MAX_EMBEDDED_SIZE)
+	len = MAX_EMBEDDED_SIZE;
+      stream = g_mime_stream_substream(content, content->bound_start,
+				       content->bound_start + len);
+      break;
+    }
+  }
+
   GMimeMessage *msg;
-  // fprintf(stderr, "RFC822...\n");
-  stream = g_mime_stream_mem_new_with_buffer(content, strlen(content));
-  parser = g_mime_parser_new_with_stream(stream);
-  msg = g_mime_parser_construct_message(parser);
-  g_object_unref(parser);
+  {
+    stage_timer timer(STAGE_MIME_PARSE);
+    GMimeParser *parser = g_mime_parser_new_with_stream(stream);
+    msg = g_mime_parser_construct_message(parser);
+    g_object_unref(parser);
+  }
   g_object_unref(stream);
-  if (msg != 0) {
-    transform_part(msg->mime_part); 
+  if (msg != NULL) {
+    embedded_depth++;
+    transform_part(msg->mime_part);
+    embedded_depth--;
     g_object_unref(msg);
   }
 }
@@ -388,25 +828,24 @@ static void transform_message_rfc822(const char *content) {
 int counter = 0;
 
 //document* parse_article(FILE *fh, size_t len, time_t date, const char *email);
-document* parse_article(GMimeMessage* msg) {
-  //GMimeMessage *msg = 0;
-
-  tallied_length = 0;
-
-  //msg = g_mime_parser_construct_message(parser);
-
-  if (msg == 0) goto dontindex;
+/* Index a header field as field_schema says, and keep it for the
+   document data, cut to the schema's max_length. */
+static void set_field(string & value, doc_field field, const char *text, size_t len) {
+  if (len != 0)
+    xapian_index_field(field, text, len);
+  size_t max = field_schema[field].max_length;
+  if (max != 0 && len > max)
+    len = max;
+  value.assign(text, len);
+}
 
-  {
-    xapian_new_document();
-    default_charset = NULL; // TV-TODO
-    
-    if (default_charset == NULL)
-      default_charset = "iso-8859-1";
-    doc_body_length = 0;
-    const char *from = g_mime_message_get_sender(msg);
+/* Index and save the author and subject, from the sender and subject as
+   GMime gives them. */
+static void parse_headers(document & doc, const char *from, const char *subj) {
+    parse_state & state = cur_state();
     if (from) {
-	string name = from;
+	string & name = state.name;
+	name = from;
 	/* if (strstr(from, "=?")) {
 	    char * copy = strdup(from);
 	    if (!copy) {
@@ -444,7 +883,8 @@ document* parse_article(GMimeMessage* msg) {
 
 	if (name.empty()) name = from; */
 
-	string author;
+	string & author = state.author;
+	author.erase();
 	InternetAddressList *iaddr_list;
 	if ((iaddr_list = internet_address_list_parse_string(name.c_str())) != NULL &&
 	    internet_address_list_length(iaddr_list) > 0) {
@@ -453,7 +893,8 @@ document* parse_article(GMimeMessage* msg) {
 
 	    if (iaddr->name) author = iaddr->name;
 
-	    string pre = author;
+	    string & pre = state.pre;
+	    pre = author;
 	    // Convert any \" to ".
 	    for (size_t i = 0; (i = author.find("\\\"", i)) != string::npos; ++i) {
 		author.replace(i, 2, "\"");
@@ -496,14 +937,7 @@ document* parse_article(GMimeMessage* msg) {
                   cout << "Stripped " << pre << " to " << author << endl;
 	    }
 
-	    if (!author.empty()) {
-		xapian_tokenise("A", author.data(), author.size());
-		if (author.size() > MAX_HEADER_LENGTH)
-		    author.resize(MAX_HEADER_LENGTH);
-		doc.author = author;
-	    } else {
-		doc.author.erase();
-	    }
+	    set_field(doc.author, FIELD_AUTHOR, author.data(), author.size());
 
 	    if (INTERNET_ADDRESS_IS_MAILBOX(iaddr)) {
 		doc.email = INTERNET_ADDRESS_MAILBOX(iaddr)->addr;
@@ -524,11 +958,13 @@ document* parse_article(GMimeMessage* msg) {
 		    doc.email.resize(doc.email.size() - 1);
 		}
 	    }
+	    if (!doc.email.empty())
+		xapian_index_field(FIELD_EMAIL, doc.email.data(), doc.email.size());
 	    g_object_unref(iaddr_list);
 	} else {
             if (verbose > 0)
               cout << "Failed to parse From: " << name << endl;
-	    doc.author = name;
+	    set_field(doc.author, FIELD_AUTHOR, name.data(), name.size());
 	    doc.email.erase();
 	}
     } else {
@@ -536,9 +972,8 @@ document* parse_article(GMimeMessage* msg) {
 	doc.email.erase();
     }
 
-    const char * subj = g_mime_message_get_subject(msg);
     if (subj) {
-      char * subject = strdup(subj);
+      char * subject = arena_strndup(subj, strlen(subj));
       /* g_mime_message_get_subject decodes to UTF8 allright.
        * unless there are problems? but the below doesn't help.
        cerr << "s1:" << subj << endl;
@@ -564,17 +999,41 @@ document* parse_article(GMimeMessage* msg) {
 	  p = s + 3;
 	  while (isspace(*p)) ++p;
 	}
-	if (*s) {
-	  size_t len = strlen((char *)s);
-	  tally((char *)s, 0, len);
-	  if (len > MAX_HEADER_LENGTH) s[MAX_HEADER_LENGTH] = 0;
-	  doc.subject = (char *)s;
-	}
-	free(subject);
+	if (*s)
+	  set_field(doc.subject, FIELD_SUBJECT, (char *)s, strlen((char *)s));
       }
     } else {
       doc.subject.erase();
     }
+}
+
+/* Get ready to parse an article into the current document. */
+static document & begin_article(void) {
+  document & doc = cur_doc();
+
+  tallied_length = 0;
+  message_truncated = false;
+  xapian_new_document();
+  default_charset = NULL; // TV-TODO
+
+  if (default_charset == NULL)
+    default_charset = "iso-8859-1";
+  doc_body_length = 0;
+  return doc;
+}
+
+document* parse_article(GMimeMessage* msg) {
+  //GMimeMessage *msg = 0;
+
+  //msg = g_mime_parser_construct_message(parser);
+
+  if (msg == 0) goto dontindex;
+
+  {
+    arena_reset();
+    document & doc = begin_article();
+    parse_headers(doc, g_mime_message_get_sender(msg),
+		  g_mime_message_get_subject(msg));
 
     {
       int gmt_offset;
@@ -588,20 +1047,207 @@ document* parse_article(GMimeMessage* msg) {
     transform_part(msg->mime_part); 
 
     // g_object_unref(msg);
-  }  
-  doc.body[doc_body_length] = '\0';
+    doc.body[doc_body_length] = '\0';
 
-  return &doc;
+    return &doc;
+  }  
 
 dontindex:
   // if (msg) g_object_unref(msg);
   return NULL;
 }
 
+/* Parse "text/plain; charset=..." as GMime would, or return false for
+   any other type or anything GMime might read differently (comments,
+   RFC 2231 parameters, escapes). */
+static bool simple_text_plain(const char *p, const char * & charset) {
+  while (isspace((unsigned char)*p)) p++;
+  if (strncasecmp(p, "text/plain", 10) != 0) return false;
+  p += 10;
+  while (true) {
+    while (isspace((unsigned char)*p)) p++;
+    if (*p == '\0') return true;
+    if (*p++ != ';') return false;
+    while (isspace((unsigned char)*p)) p++;
+    if (*p == '\0') return true;
+    const char *name = p;
+    while (*p && *p != '=' && *p != ';' && !isspace((unsigned char)*p)) {
+      if (*p == '*' || *p == '(' || *p == '"') return false;
+      p++;
+    }
+    size_t name_len = p - name;
+    if (*p++ != '=') return false;
+    const char *v;
+    size_t v_len;
+    if (*p == '"') {
+      const char *close = strchr(++p, '"');
+      if (close == NULL || memchr(p, '\\', close - p)) return false;
+      v = p;
+      v_len = close - p;
+      p = close + 1;
+    } else {
+      v = p;
+      while (*p && *p != ';' && !isspace((unsigned char)*p)) {
+        if (*p == '(' || *p == '"') return false;
+        p++;
+      }
+      v_len = p - v;
+    }
+    if (name_len == 7 && strncasecmp(name, "charset", 7) == 0) {
+      if (v_len == 0) return false;
+      for (size_t i = 0; i + 1 < v_len; i++)
+        if (v[i] == '=' && v[i + 1] == '?') return false;
+      charset = arena_strndup(v, v_len);
+    }
+  }
+}
+
+/* The headers parse_simple_article() looks at. */
+enum {
+  SIMPLE_FROM,
+  SIMPLE_SUBJECT,
+  SIMPLE_DATE,
+  SIMPLE_CONTENT_TYPE,
+  SIMPLE_CONTENT_TRANSFER_ENCODING,
+  SIMPLE_HEADERS
+};
+
+static const char * const simple_header_names[SIMPLE_HEADERS] = {
+  "From",
+  "Subject",
+  "Date",
+  "Content-Type",
+  "Content-Transfer-Encoding"
+};
+
+document* parse_simple_article(const char *data, size_t len) {
+  const char *end = data + len;
+  const char *p = data;
+  // Each header's value, or NULL if it's not there.
+  const char *values[SIMPLE_HEADERS] = { NULL, NULL, NULL, NULL, NULL };
+  const char *charset = NULL;
+  GMimeContentEncoding encoding = GMIME_CONTENT_ENCODING_DEFAULT;
+
+  arena_reset();
+
+  {
+    stage_timer timer(STAGE_MIME_PARSE);
+    // Leave anything we might read differently from GMime to GMime:
+    // the headers we use repeated, folded or with trailing whitespace,
+    // and CRLF line ends.
+    int last = -1;
+    while (true) {
+      const char *eol = (const char *)memchr(p, '\n', end - p);
+      if (eol == NULL || *p == '\r') return NULL;
+      if (eol == p) {
+        p = eol + 1;
+        break;
+      }
+      if (*p == ' ' || *p == '\t') {
+        if (last >= 0) return NULL;
+        p = eol + 1;
+        continue;
+      }
+      const char *colon = (const char *)memchr(p, ':', eol - p);
+      if (colon == NULL) return NULL;
+      last = -1;
+      for (int h = 0; h < SIMPLE_HEADERS; h++) {
+        size_t n = strlen(simple_header_names[h]);
+        if ((size_t)(colon - p) == n && strncasecmp(p, simple_header_names[h], n) == 0) {
+          last = h;
+          break;
+        }
+      }
+      if (last >= 0) {
+        if (values[last] != NULL) return NULL;
+        const char *v = colon + 1;
+        while (v < eol && (*v == ' ' || *v == '\t')) v++;
+        if (v < eol && isspace((unsigned char)eol[-1])) return NULL;
+        values[last] = arena_strndup(v, eol - v);
+      }
+      p = eol + 1;
+    }
+
+    if (values[SIMPLE_CONTENT_TYPE] != NULL &&
+        !simple_text_plain(values[SIMPLE_CONTENT_TYPE], charset))
+      return NULL;
+    if (values[SIMPLE_CONTENT_TRANSFER_ENCODING] != NULL) {
+      const char *cte = values[SIMPLE_CONTENT_TRANSFER_ENCODING];
+      if (strcasecmp(cte, "quoted-printable") == 0)
+        encoding = GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE;
+      else if (strcasecmp(cte, "base64") == 0)
+        encoding = GMIME_CONTENT_ENCODING_BASE64;
+      else if (strcasecmp(cte, "7bit") != 0 && strcasecmp(cte, "8bit") != 0 &&
+               strcasecmp(cte, "binary") != 0)
+        return NULL;
+    }
+  }
+
+  // What GMime's message object would give as the sender and subject.
+  char *sender = NULL;
+  if (values[SIMPLE_FROM] != NULL) {
+    InternetAddressList *addrs =
+      internet_address_list_parse_string(values[SIMPLE_FROM]);
+    if (addrs == NULL) return NULL;
+    if (internet_address_list_length(addrs) > 0)
+      sender = internet_address_list_to_string(addrs, FALSE);
+    g_object_unref(addrs);
+    if (sender == NULL) return NULL;
+  }
+  char *subject = NULL;
+  if (values[SIMPLE_SUBJECT] != NULL)
+    subject = g_mime_utils_header_decode_text(values[SIMPLE_SUBJECT]);
+
+  document & doc = begin_article();
+  parse_headers(doc, sender, subject);
+  g_free(sender);
+  g_free(subject);
+  doc.date = 0;
+  if (values[SIMPLE_DATE] != NULL) {
+    int gmt_offset;
+    doc.date = g_mime_utils_header_decode_date(values[SIMPLE_DATE], &gmt_offset);
+  }
+
+  const char *body_charset = charset ? charset : default_charset;
+  size_t body_len;
+  char *content = decode_raw(encoding, body_charset, p, end - p, body_len);
+  char *converted = convert_to_utf8(content, body_len, body_charset);
+  transform_text_plain(converted ? converted : content);
+  free(converted);
+  release_scratch();
+
+  doc.body[doc_body_length] = '\0';
+  return &doc;
+}
+
 void tokenizer_init(void) {
   g_mime_init(GMIME_ENABLE_RFC2047_WORKAROUNDS);
+  for (int c = 0x80; c < 0x100; c++) {
+    latin1_utf8[c - 0x80][0] = (char)(0xc0 | (c >> 6));
+    latin1_utf8[c - 0x80][1] = (char)(0x80 | (c & 0x3f));
+  }
 }
 
 void tokenizer_fini(void) {
+  free_converters();
+  free_scratch(raw_scratch);
+  free_scratch(decode_scratch);
+  free_scratch(text_scratch);
+  free_arena();
   g_mime_shutdown();
 }
+
+void tokenizer_thread_init(void) {
+  if (thread_state == NULL)
+    thread_state = new parse_state;
+}
+
+void tokenizer_thread_fini(void) {
+  free_converters();
+  free_scratch(raw_scratch);
+  free_scratch(decode_scratch);
+  free_scratch(text_scratch);
+  free_arena();
+  delete thread_state;
+  thread_state = NULL;
+}
@@ -10,7 +10,13 @@
    before they are tokenized.  */
 #define MAX_MESSAGE_SIZE (1024*512)
 
-/* Only this many characters from a header are considered. */
+/* Messages inside messages (message/rfc822 parts and digests) are only
+   followed this deep, and no more than this much of each is parsed. */
+#define MAX_EMBEDDED_DEPTH 8
+#define MAX_EMBEDDED_SIZE (4 * MAX_MESSAGE_SIZE)
+
+/* Only this many bytes of the subject and author are kept in the
+   document data; see field_schema in xapianglue.h. */
 #define MAX_HEADER_LENGTH 80
 
 /* How many bytes of text from the body that will be saved in the data
@@ -29,10 +35,32 @@ typedef struct {
 } document;
 
 document* parse_article(GMimeMessage* msg);
+/* parse_article() for one raw message (headers and body, without the
+   From_ line), for the common case of a single text/plain part, without
+   building a MIME tree.  Returns NULL, having done nothing, for any other
+   message, which should then go through parse_article(). */
+document* parse_simple_article(const char *data, size_t len);
 
 //document* parse_article(FILE *fh, size_t len, time_t date, const char *email);
 
+/* How the quoted lines (those starting with '>') of plain text bodies
+   are indexed: like the rest of the body, not at all, or without
+   positions under the FIELD_QUOTED prefix, so they only match searches
+   which ask for quoted text as well.  With QUOTED_LOW the rest of the
+   message is indexed at a higher wdf, so quoted text weighs less. */
+enum quoted_mode {
+  QUOTED_INDEX = 0,
+  QUOTED_SKIP,
+  QUOTED_LOW
+};
+void tokenizer_set_quoted(quoted_mode mode);
+
 void tokenizer_init(void);
 void tokenizer_fini(void);
 
+/* Give the calling thread its own parse state; the document returned by
+   parse_article() is then only valid in that thread. */
+void tokenizer_thread_init(void);
+void tokenizer_thread_fini(void);
+
 #endif
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <iostream>
 #include <gcrypt.h>
+#include <unistd.h>
 
 using namespace std;
 int verbose = 0;
@@ -26,21 +27,23 @@ void merror(const char *error) {
 static bool have_inited_gnutls = false;
 static char hexchars[] = "0123456789abcdef";
 
-// mhonarc-style msgid
-string fake_msgid(GMimeMessage* msg) 
+static void init_gcrypt()
 {
-   gcry_md_hd_t md5;
-   string res;
-   
    if (! have_inited_gnutls) {
       gcry_control( GCRYCTL_DISABLE_SECMEM_WARN );
       gcry_control( GCRYCTL_INIT_SECMEM, 16384, 0 );
       have_inited_gnutls = true;
    }
+}
+
+string md5_hex(const char *data, size_t len)
+{
+   gcry_md_hd_t md5;
+   string res;
+
+   init_gcrypt();
    gcry_md_open(&md5, GCRY_MD_MD5,0);
-   char* headers = g_mime_object_get_headers(GMIME_OBJECT(msg));
-   gcry_md_write(md5,headers,strlen(headers)); /*<-- this should create the checksum*/
-   free(headers);
+   gcry_md_write(md5,data,len); /*<-- this should create the checksum*/
    gcry_md_final( md5 );
    unsigned char *digest = gcry_md_read( md5, GCRY_MD_MD5 );
    for (unsigned i=0; i<gcry_md_get_algo_dlen( GCRY_MD_MD5 ); i++ ) {
@@ -48,7 +51,32 @@ string fake_msgid(GMimeMessage* msg)
       res += hexchars[digest[i] & 0xF];
    }
    gcry_md_close(md5);
+   return res;
+}
+
+// mhonarc-style msgid
+string fake_msgid(GMimeMessage* msg) 
+{
+   char* headers = g_mime_object_get_headers(GMIME_OBJECT(msg));
+   string res = md5_hex(headers, strlen(headers));
+   free(headers);
    res += "@NO-ID-FOUND.mhonarc.org";
    return res;
   
 }
+
+/* Hash the PREFIX_HASH_BYTES bytes before offset plus the "From " that
+   should start there.  Returns an empty string if the file is too short,
+   so a truncated or rewritten mbox never matches a stored checkpoint. */
+string mbox_prefix_hash(int fd, long long offset)
+{
+   char buf[PREFIX_HASH_BYTES + 5];
+   long long start = offset - PREFIX_HASH_BYTES;
+   if (start < 0)
+      start = 0;
+   size_t want = offset + 5 - start;
+   ssize_t got = pread(fd, buf, want, start);
+   if (got != (ssize_t)want || memcmp(buf + want - 5, "From ", 5) != 0)
+      return string();
+   return md5_hex(buf, want);
+}
@@ -14,7 +14,12 @@ void merror(const char *error);
 }
 #endif
 
+/* How much of an mbox before a checkpoint is hashed to validate it. */
+#define PREFIX_HASH_BYTES 4096
+
+std::string md5_hex(const char *data, size_t len);
 std::string fake_msgid(GMimeMessage* msg);
+std::string mbox_prefix_hash(int fd, long long offset);
 extern int verbose;
 
 #endif
@@ -0,0 +1,196 @@
+#include "watch.h"
+#include "util.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+/* Lists are one level below the top of the archive and years two, so
+   nothing deeper is watched. */
+#define WATCH_DEPTH 2
+
+struct watched_dir {
+  string path;
+  int depth;
+};
+
+static int inotify_fd = -1;
+static map<int, watched_dir> watched;
+// The size of each mbox when it was last reported.
+static map<string, long long> sizes;
+
+/* The name of the mbox that a file in the archive is, or is the spam list
+   of; "" if it is neither. */
+static string mbox_of(const char *name)
+{
+  string n(name);
+  if (n.size() > 5 && n.compare(n.size() - 5, 5, ".spam") == 0)
+    n.erase(n.size() - 5);
+  size_t dash = n.find_last_of('-');
+  if (dash == string::npos || dash == 0)
+    return "";
+  size_t digits = n.size() - dash - 1;
+  if (digits != 4 && digits != 6)
+    return "";
+  for (size_t i = dash + 1; i < n.size(); i++)
+    if (! isdigit((unsigned char)n[i]))
+      return "";
+  return n;
+}
+
+static void note_mbox(const string & path, bool spam, set<string> & changed)
+{
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || ! S_ISREG(st.st_mode)) {
+    sizes.erase(path);
+    return;
+  }
+  map<string, long long>::iterator i = sizes.find(path);
+  // Touching an mbox without changing it isn't worth reindexing for.
+  if (! spam && i != sizes.end() && i->second == (long long)st.st_size)
+    return;
+  sizes[path] = st.st_size;
+  changed.insert(path);
+}
+
+static void watch_dir(const string & path, int depth, set<string> * changed);
+
+/* Watch the directories in path, and with changed, report its mboxes as
+   changed if they aren't the size they were. */
+static void scan_dir(const string & path, int depth, set<string> * changed)
+{
+  DIR *dir = opendir(path.c_str());
+  if (dir == NULL)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    string full = path + "/" + entry->d_name;
+    struct stat st;
+    if (depth < WATCH_DEPTH && stat(full.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+      watch_dir(full, depth + 1, changed);
+    }
+    else if (changed != NULL) {
+      string name = mbox_of(entry->d_name);
+      if (! name.empty())
+	note_mbox(path + "/" + name, name.size() != strlen(entry->d_name), *changed);
+    }
+  }
+  closedir(dir);
+}
+
+static void watch_dir(const string & path, int depth, set<string> * changed)
+{
+  int wd = inotify_add_watch(inotify_fd, path.c_str(),
+			     IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+  if (wd < 0) {
+    cerr << "Cannot watch '" << path << "': " << strerror(errno) << endl;
+    return;
+  }
+  watched[wd].path = path;
+  watched[wd].depth = depth;
+  scan_dir(path, depth, changed);
+}
+
+bool watch_start(const char *dir, set<string> & mboxes)
+{
+  inotify_fd = inotify_init();
+  if (inotify_fd < 0)
+    return false;
+  struct stat st;
+  if (stat(dir, &st) != 0)
+    return false;
+  if (! S_ISDIR(st.st_mode)) {
+    errno = ENOTDIR;
+    return false;
+  }
+  watch_dir(dir, 0, &mboxes);
+  if (verbose > 0)
+    cout << "watching " << watched.size() << " directories under " << dir << endl;
+  return true;
+}
+
+void watch_stop(void)
+{
+  if (inotify_fd >= 0)
+    close(inotify_fd);
+  inotify_fd = -1;
+  watched.clear();
+  sizes.clear();
+}
+
+int watch_wait(int timeout_ms, set<string> & changed)
+{
+  struct pollfd pfd;
+  pfd.fd = inotify_fd;
+  pfd.events = POLLIN;
+  int ready = poll(&pfd, 1, timeout_ms);
+  if (ready < 0) {
+    if (errno == EINTR)
+      return -1;
+    merror("poll");
+  }
+  if (ready == 0)
+    return 0;
+
+  static union {
+    struct inotify_event event;
+    char bytes[64 * 1024];
+  } buf;
+  ssize_t len = read(inotify_fd, buf.bytes, sizeof(buf.bytes));
+  if (len < 0) {
+    if (errno == EINTR)
+      return -1;
+    merror("read");
+  }
+  for (char *p = buf.bytes; p < buf.bytes + len; ) {
+    const struct inotify_event *e = (const struct inotify_event *)p;
+    p += sizeof(*e) + e->len;
+    if (e->mask & IN_Q_OVERFLOW) {
+      // Events were lost, so look at everything again; the sizes
+      // recorded keep this from reporting every mbox.
+      cerr << "inotify queue overflowed, rescanning" << endl;
+      vector<watched_dir> dirs;
+      for (map<int, watched_dir>::iterator i = watched.begin(); i != watched.end(); ++i)
+	dirs.push_back(i->second);
+      for (size_t i = 0; i < dirs.size(); i++)
+	scan_dir(dirs[i].path, dirs[i].depth, &changed);
+      continue;
+    }
+    map<int, watched_dir>::iterator d = watched.find(e->wd);
+    if (d == watched.end())
+      continue;
+    if (e->mask & IN_IGNORED) {
+      // The directory went away.
+      watched.erase(d);
+      continue;
+    }
+    if (e->len == 0 || e->name[0] == '.')
+      continue;
+    string path = d->second.path;
+    int depth = d->second.depth;
+    if (e->mask & IN_ISDIR) {
+      // A new list or year, with whatever is already in it.
+      if (depth < WATCH_DEPTH)
+	watch_dir(path + "/" + e->name, depth + 1, &changed);
+      continue;
+    }
+    string name = mbox_of(e->name);
+    if (! name.empty())
+      note_mbox(path + "/" + name, name.size() != strlen(e->name), changed);
+  }
+  return 1;
+}
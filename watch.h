@@ -0,0 +1,23 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <set>
+#include <string>
+
+/* Watching a list archive with inotify, laid out as doindex.py expects:
+   <dir>/<list>/<list>-<year> or <dir>/<list>/<year>/<list>-<year><month>.
+   Lists and years added while watching are picked up. */
+
+/* Start watching the archive at dir, adding the path of every mbox in
+   it to mboxes, so that whatever changed while nothing was watching can
+   be caught up with.  False, with errno set, if dir can't be watched. */
+bool watch_start(const char *dir, std::set<std::string> & mboxes);
+void watch_stop(void);
+
+/* Wait up to timeout_ms (-1 for ever) for changes, and add the path of
+   each mbox that grew or shrank, or whose .spam file changed, to changed.
+   Returns 1 if anything happened in the archive, 0 if the time ran out
+   first, or -1 if the wait was interrupted by a signal. */
+int watch_wait(int timeout_ms, std::set<std::string> & changed);
+
+#endif
@@ -1,21 +1,33 @@
 #include <xapian.h>
 
-#define INDEX_CHUNK_SIZE 1000000
-
 extern "C" {
 #include "tokenizer.h"
 #include "util.h"
 #include <glob.h>  
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sysexits.h>
+#include <sys/file.h>
+#include <unistd.h>
 }
 
 #include "xapianglue.h"
+#include "catalogue.h"
+#include "compact.h"
+#include "metrics.h"
 
 //#include "indextext.h"
 
 #include <string>
 #include <map>
+#include <set>
+#include <vector>
+#include <deque>
+#include <algorithm>
 #include <iostream>
 
 using namespace std;
@@ -23,100 +35,969 @@ using namespace std;
 // Use for the "XI" terms which index message-ids.
 const unsigned MAX_TERM_LENGTH = 250;
 
-Xapian::WritableDatabase db;
-Xapian::Document * doc = NULL;
-Xapian::TermGenerator indexer;
+const field_spec field_schema[FIELD_COUNT] = {
+    // prefix, weight, positional, whole, max_length
+    { "", 3, true, false, MAX_HEADER_LENGTH },	// FIELD_SUBJECT
+    { "A", 1, true, false, MAX_HEADER_LENGTH },	// FIELD_AUTHOR
+    { "A", 1, false, true, 0 },			// FIELD_EMAIL
+    { "XQ", 1, false, false, 0 }		// FIELD_QUOTED
+};
+
+/* The document being built and the TermGenerator building it.  Each
+   pipeline worker gets its own from xapian_thread_init(); all other
+   threads share main_context. */
+struct indexing_context {
+    Xapian::Document * doc;
+    Xapian::TermGenerator indexer;
+    string language, stemmer_language;
+    // Reused for building terms and document data, so their buffers are
+    // only allocated once.
+    string term, data;
+
+    indexing_context() : doc(NULL) { }
+};
+
+static indexing_context main_context;
+static __thread indexing_context * thread_context = NULL;
+
+static inline indexing_context & ctx(void)
+{
+    return thread_context ? *thread_context : main_context;
+}
 
 static string dbpathprefix("/srv/lists.debian.org/xapian/data/listdb");
 
 static int counter = 0;
-static string language, stemmer_language;
+
+/* The shards of dbpathprefix are dbpathprefix-NNN.  Matching the digits
+   keeps out the series of other indexers sharing the prefix, such as
+   doindex.py --processes runs as dbpathprefix-jNN. */
+static string shard_glob()
+{
+  return dbpathprefix + "-[0-9][0-9][0-9]*";
+}
+
+static catalogue cat;
+
+/* A change to a shard, applied in the order queued. */
+struct shard_op {
+    enum { REPLACE, DELETE, SET_METADATA } kind;
+    xapian_month * month;
+    string term;		// Q id, or metadata key
+    string value;		// metadata value
+    string number_key;		// DELETE: "XN" key of the message-id
+    int msgnum;
+    Xapian::Document * doc;	// owned by the op, unless keep_doc
+    bool keep_doc;
+
+    shard_op() : month(NULL), msgnum(-1), doc(NULL), keep_doc(false) { }
+};
+
+/* Every shard written to in this run stays open in its own writer, so
+   moving between months in different shards doesn't close and reopen
+   databases.  Each writer commits on its own once commit_interval
+   documents are pending, and with writer threads (-W) applies its
+   changes in a thread of its own, so several shards can be written at
+   once. */
+struct shard_writer {
+    string path;
+    Xapian::WritableDatabase db;
+    size_t unflushed;
+    int state;			// a shard_state, as in its "XS" metadata
+    bool modes_noted;		// "XB" and "XQ" brought up to date in this run
+    bool touched;		// written to since the last xapian_flush()
+
+    // Rebuilding (--rebuild): db is a new database beside the shard,
+    // which old keeps locked until xapian_fini() swaps db in.
+    bool fresh;
+    string fresh_path;
+    Xapian::WritableDatabase old;
+    set<string> rebuilt;	// months indexed into db
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t applied;
+    deque<shard_op *> ops;
+    bool busy;
+    bool stopping;
+};
+
+struct xapian_month {
+    string name;		// <list>-<month>
+    month_info * info;		// its catalogue entry
+    shard_writer * shard;
+};
+
+static map<string, shard_writer *> writers;
+static map<string, xapian_month> months;
+// The month main() is indexing.
+static xapian_month * current = NULL;
+
+static bool writer_threads = false;
+static size_t commit_interval = 0;
+static bool rebuild = false;
+// How long to wait for another process to let go of a series or shard.
+static int lock_wait = 0;
+// The series lock, held from xapian_init() to the end of xapian_fini().
+static int series_fd = -1;
+// Whether errors, a locked series or shard included, are thrown to the
+// caller rather than aborting or exiting.
+static bool throw_errors = false;
+// Whether body text is indexed with positions, recorded in each shard's
+// "XB" metadata as "positions", "none", or "mixed" once it has both.
+static bool body_positions = true;
+// How quoted text is indexed, recorded in each shard's "XQ" metadata as
+// "index", "skip", "low", or "mixed".
+static quoted_mode quoted = QUOTED_INDEX;
+
+/* With --quoted low, everything but quoted text is indexed at this many
+   times its usual wdf, so that quoted text, at 1, counts for less. */
+#define QUOTED_LOW_BOOST 2
+
+// A shard takes no new months once it reaches either limit (0 = none).
+static unsigned long shard_max_docs = INDEX_CHUNK_SIZE;
+static long long shard_max_bytes = 0;
+
+/* Sealed shards waiting for the compaction thread, which leaves alone
+   any shard with a writer open until the first xapian_flush() after it
+   was sealed closes it, or xapian_fini() does.  compact_lock also
+   covers inserting into and erasing from writers, and get_writer()
+   waits for a shard being compacted. */
+static bool compaction = false;
+static pthread_t compact_thread;
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+static deque<string> to_compact;
+static set<string> compacting;
+static vector<string> compacted;	// done, not yet in the catalogue
+static bool compact_stopping = false;
+
+static int shard_state_from(const string & value)
+{
+    if (value == "sealed")
+	return SHARD_SEALED;
+    if (value == "compacted")
+	return SHARD_COMPACTED;
+    return SHARD_OPEN;
+}
+
+// Record the shards' counts, as checked when loading the catalogue.
+static void note_shard_stats(void)
+{
+    for (size_t i = 0; i < cat.shards.size(); ++i) {
+	map<string, shard_writer *>::iterator w = writers.find(cat.shards[i].path);
+	if (w != writers.end() && ! w->second->fresh) {
+	    // Just committed, so the files on disk hold these counts.
+	    cat.shards[i].stamp = catalogue_stamp(cat.shards[i].path);
+	    cat.shards[i].doccount = w->second->db.get_doccount();
+	    cat.shards[i].lastdocid = w->second->db.get_lastdocid();
+	    cat.shards[i].state = w->second->state;
+	}
+    }
+}
+
+// Record the shards the compaction thread has finished with.
+static void note_compacted(void)
+{
+    pthread_mutex_lock(&compact_lock);
+    for (size_t j = 0; j < compacted.size(); ++j)
+	for (size_t i = 0; i < cat.shards.size(); ++i)
+	    if (cat.shards[i].path == compacted[j]) {
+		cat.shards[i].state = SHARD_COMPACTED;
+		// A new copy, to be opened to check at the next start.
+		cat.shards[i].stamp.clear();
+	    }
+    compacted.clear();
+    pthread_mutex_unlock(&compact_lock);
+}
+
+/* A message that takes a msgnum but has no document, being spam or
+   impossible to parse, is noted in the month's shard as user metadata
+   "XN<list>-<month>:<md5 of its message-id>" = "<msgnum>", so a later
+   copy of it is still known for a duplicate. */
+static string number_key(const string & month, const string & msgid)
+{
+    return "XN" + month + ":" + md5_hex(msgid.data(), msgid.size());
+}
+
+// The "XN" keys of month in a_db.
+static void
+number_keys(const Xapian::Database & a_db, const string & month, vector<string> & keys)
+{
+    const string prefix("XN" + month + ":");
+    for (Xapian::TermIterator k = a_db.metadata_keys_begin(prefix);
+	 k != a_db.metadata_keys_end(prefix);
+	 ++k)
+	keys.push_back(*k);
+}
+
+/* Each month's high-water mark is also kept in its shard as user metadata
+   "XH<list>-<month>" = "<maxmsgnum> <doccount>".  It is updated with
+   every write, so it is committed along with the documents and finding
+   where to continue never needs a walk over the month's Q terms. */
+static void store_high_water(xapian_month * m)
+{
+    char buf[64];
+    sprintf(buf, "%d %lu", m->info->maxmsgnum, m->info->doccount);
+    m->shard->db.set_metadata(string("XH")+m->name, buf);
+}
+
+static bool
+load_high_water(const Xapian::Database & a_db, const string & month, month_info & m)
+{
+    string value = a_db.get_metadata(string("XH")+month);
+    int maxmsgnum;
+    unsigned long doccount;
+    if (sscanf(value.c_str(), "%d %lu", &maxmsgnum, &doccount) != 2)
+	return false;
+    m.maxmsgnum = maxmsgnum;
+    m.doccount = doccount;
+    return true;
+}
+
+time_t start_time;
+static time_t last_start_time = 0;
+static int last_total_files = 0;
+static int total_files = 0;
+// Writer threads share the progress counters.
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void note_progress(void)
+{
+    pthread_mutex_lock(&progress_lock);
+    ++total_files;
+    
+    if ((total_files % 10000) == 0) {
+	time_t now = time(NULL);
+	time_t elapsed = now - start_time;
+	if (last_start_time == 0) last_start_time = start_time;
+	if (elapsed != 0) {
+	    int last_elapsed = now - last_start_time;
+	    int last_rate = 0;
+	    if (last_elapsed)
+		last_rate = (total_files - last_total_files) / last_elapsed;
+            if (verbose > 0)
+	      printf("    %d files (%d/s; %d/s last %d seconds)\n",
+                     total_files, (int)(total_files/elapsed), last_rate,
+                     last_elapsed);
+	    last_start_time = now;
+	    last_total_files = total_files;
+	}
+    }
+    pthread_mutex_unlock(&progress_lock);
+}
+
+static void queue_compaction(const string & path)
+{
+    if (! compaction)
+	return;
+    pthread_mutex_lock(&compact_lock);
+    if (find(to_compact.begin(), to_compact.end(), path) == to_compact.end()) {
+	to_compact.push_back(path);
+	pthread_cond_broadcast(&compact_cond);
+    }
+    pthread_mutex_unlock(&compact_lock);
+}
+
+static const char * body_mode(bool positions)
+{
+    return positions ? "positions" : "none";
+}
+
+static const char * quoted_mode_name(quoted_mode mode)
+{
+    static const char * const names[] = { "index", "skip", "low" };
+    return names[mode];
+}
+
+/* Record in w's metadata key that its documents are indexed as now
+   says, or "mixed" if some already were otherwise.  Documents from
+   before the key was recorded were indexed as before says. */
+static void note_mode(shard_writer * w, const char * key, const string & now,
+		      const string & before)
+{
+    string mode = w->db.get_metadata(key);
+    if (mode.empty())
+	mode = (w->db.get_doccount() != 0) ? before : now;
+    if (mode != now)
+	mode = "mixed";
+    w->db.set_metadata(key, mode);
+}
+
+/* Record in "XB" how the body text of the documents going into w is
+   indexed, and in "XQ" how their quoted text is.  Shards from before
+   these were recorded have positions and quoted text indexed like the
+   rest of the body. */
+static void note_modes(shard_writer * w)
+{
+    w->modes_noted = true;
+    note_mode(w, "XB", body_mode(body_positions), body_mode(true));
+    note_mode(w, "XQ", quoted_mode_name(quoted), quoted_mode_name(QUOTED_INDEX));
+}
+
+/* Called in the handler for e: pass it on to the caller, or abort as
+   the indexers always have. */
+static void failed(const Xapian::Error & e)
+{
+    if (throw_errors)
+	throw;
+    merror(e.get_msg().c_str());
+}
+
+static void apply(shard_writer * w, shard_op * op)
+{
+    w->touched = true;
+    try {
+	if (op->kind != shard_op::SET_METADATA && w->state == SHARD_COMPACTED) {
+	    // Changed since it was compacted, so it wants compacting again.
+	    w->db.set_metadata("XS", "sealed");
+	    w->state = SHARD_SEALED;
+	    queue_compaction(w->path);
+	}
+	switch (op->kind) {
+	  case shard_op::REPLACE: {
+	    month_info * info = op->month->info;
+	    stage_timer timer(STAGE_REPLACE);
+	    if (! w->modes_noted)
+		note_modes(w);
+	    if (w->fresh) {
+		// Nothing to replace in a new database.
+		w->db.add_document(*op->doc);
+		info->doccount++;
+	    }
+	    else {
+		Xapian::docid lastdocid = w->db.get_lastdocid();
+		if (w->db.replace_document(op->term, *op->doc) > lastdocid)
+		    info->doccount++;
+	    }
+	    if (op->msgnum > info->maxmsgnum)
+		info->maxmsgnum = op->msgnum;
+	    store_high_water(op->month);
+	    note_progress();
+	    if (commit_interval != 0 && ++w->unflushed >= commit_interval) {
+		stage_timer commit_timer(STAGE_COMMIT);
+		w->db.commit();
+		w->unflushed = 0;
+	    }
+	    break;
+	  }
+	  case shard_op::DELETE: {
+	    month_info * info = op->month->info;
+	    // A new database only has what this run added.
+	    if (! w->fresh && w->db.term_exists(op->term)) {
+		w->db.delete_document(op->term);
+		if (info->doccount > 0)
+		    info->doccount--;
+	    }
+	    // No document, but the message still takes its msgnum.
+	    if (! op->number_key.empty()) {
+		char buf[16];
+		sprintf(buf, "%d", op->msgnum);
+		w->db.set_metadata(op->number_key, buf);
+	    }
+	    if (op->msgnum > info->maxmsgnum)
+		info->maxmsgnum = op->msgnum;
+	    store_high_water(op->month);
+	    break;
+	  }
+	  case shard_op::SET_METADATA:
+	    w->db.set_metadata(op->term, op->value);
+	    break;
+	}
+    } catch (const Xapian::Error &e) {
+	if (! op->keep_doc)
+	    delete op->doc;
+	delete op;
+	failed(e);
+	return;
+    }
+    if (! op->keep_doc)
+	delete op->doc;
+    delete op;
+}
+
+static void * shard_thread(void * arg)
+{
+    shard_writer * w = (shard_writer *)arg;
+    pthread_mutex_lock(&w->lock);
+    while (true) {
+	while (w->ops.empty() && !w->stopping)
+	    pthread_cond_wait(&w->queued, &w->lock);
+	if (w->ops.empty())
+	    break;
+	shard_op * op = w->ops.front();
+	w->ops.pop_front();
+	w->busy = true;
+	pthread_mutex_unlock(&w->lock);
+
+	apply(w, op);
+
+	pthread_mutex_lock(&w->lock);
+	w->busy = false;
+	pthread_cond_broadcast(&w->applied);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void submit(shard_writer * w, shard_op * op)
+{
+    if (! writer_threads) {
+	apply(w, op);
+	return;
+    }
+    pthread_mutex_lock(&w->lock);
+    w->ops.push_back(op);
+    pthread_cond_signal(&w->queued);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Wait until everything queued for w has been applied.
+static void drain(shard_writer * w)
+{
+    if (! writer_threads)
+	return;
+    pthread_mutex_lock(&w->lock);
+    while (! w->ops.empty() || w->busy)
+	pthread_cond_wait(&w->applied, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Open path for writing, waiting up to lock_wait seconds if another
+   process has it open.  A shard still locked after that is a temporary
+   failure: the process exits with EX_TEMPFAIL, for whatever ran it to
+   try again later, rather than aborting as on other errors; with
+   throw_errors, the DatabaseLockError is thrown instead. */
+static Xapian::WritableDatabase open_writable(const string & path, int action)
+{
+    for (int waited = 0; ; waited++) {
+	try {
+	    return Xapian::WritableDatabase(path, action);
+	} catch (const Xapian::DatabaseLockError &e) {
+	    if (waited >= lock_wait) {
+		if (throw_errors)
+		    throw;
+		cerr << path << ": " << e.get_msg() << endl;
+		exit(EX_TEMPFAIL);
+	    }
+	}
+	sleep(1);
+    }
+}
+
+static shard_writer * get_writer(const string & path)
+{
+    pthread_mutex_lock(&compact_lock);
+    map<string, shard_writer *>::iterator i = writers.find(path);
+    if (i != writers.end()) {
+	pthread_mutex_unlock(&compact_lock);
+	return i->second;
+    }
+    while (compacting.count(path))
+	pthread_cond_wait(&compact_cond, &compact_lock);
+
+    shard_writer * w = new shard_writer;
+    w->path = path;
+    w->fresh = rebuild && access(path.c_str(), F_OK) == 0;
+    try {
+	if (w->fresh) {
+	    w->old = open_writable(path, Xapian::DB_OPEN);
+	    w->fresh_path = shard_sibling(path, "rebuild");
+	    w->db = open_writable(w->fresh_path, Xapian::DB_CREATE_OR_OVERWRITE);
+	    w->state = shard_state_from(w->old.get_metadata("XS"));
+	    if (w->state != SHARD_OPEN) {
+		// The new copy wants compacting again.
+		w->db.set_metadata("XS", "sealed");
+		w->state = SHARD_SEALED;
+	    }
+	}
+	else {
+	    w->db = open_writable(path, Xapian::DB_CREATE_OR_OPEN);
+	    w->state = shard_state_from(w->db.get_metadata("XS"));
+	}
+    } catch (...) {
+	pthread_mutex_unlock(&compact_lock);
+	delete w;
+	throw;
+    }
+    w->unflushed = 0;
+    w->modes_noted = false;
+    w->touched = false;
+    w->busy = false;
+    w->stopping = false;
+    if (writer_threads) {
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->queued, NULL);
+	pthread_cond_init(&w->applied, NULL);
+	if (pthread_create(&w->thread, NULL, shard_thread, w) != 0)
+	    merror("pthread_create");
+    }
+    writers[path] = w;
+    pthread_mutex_unlock(&compact_lock);
+    return w;
+}
+
+static void * compact_main(void *)
+{
+    pthread_mutex_lock(&compact_lock);
+    while (true) {
+	deque<string>::iterator i;
+	for (i = to_compact.begin(); i != to_compact.end(); ++i)
+	    if (writers.find(*i) == writers.end())
+		break;
+	if (i == to_compact.end()) {
+	    if (compact_stopping)
+		break;
+	    pthread_cond_wait(&compact_cond, &compact_lock);
+	    continue;
+	}
+	string path = *i;
+	to_compact.erase(i);
+	compacting.insert(path);
+	pthread_mutex_unlock(&compact_lock);
+
+	bool ok = compact_shard(path);
+
+	pthread_mutex_lock(&compact_lock);
+	compacting.erase(path);
+	if (ok)
+	    compacted.push_back(path);
+	pthread_cond_broadcast(&compact_cond);
+    }
+    pthread_mutex_unlock(&compact_lock);
+    return NULL;
+}
+
+static bool shard_full(shard_writer * w)
+{
+    /* While rebuilding, only the rebuilt copy counts: the old copy
+       still holds the months being indexed again. */
+    if (shard_max_docs != 0 && w->db.get_doccount() >= shard_max_docs)
+	return true;
+    long long bytes = shard_bytes(w->fresh ? w->fresh_path : w->path);
+    return shard_max_bytes != 0 && bytes >= shard_max_bytes;
+}
+
+/* Merge the old copy's metadata key into the rebuilt copy's, for the
+   documents copied over from it; before is what a missing key means. */
+static void carry_mode(shard_writer * w, const char * key, const string & before)
+{
+    string old_mode = w->old.get_metadata(key);
+    if (old_mode.empty())
+	old_mode = before;
+    string mode = w->db.get_metadata(key);
+    if (mode.empty())
+	mode = old_mode;
+    else if (mode != old_mode)
+	mode = "mixed";
+    w->db.set_metadata(key, mode);
+}
+
+/* Finish a rebuilt shard: copy over the months this run didn't index
+   from the old copy, then swap the new one in. */
+static bool publish(shard_writer * w)
+{
+    try {
+	const string prefix("XM");
+	bool copied = false;
+	for (Xapian::TermIterator t = w->old.allterms_begin(prefix);
+	     t != w->old.allterms_end(prefix);
+	     ++t) {
+	    string month = (*t).substr(2);
+	    if (w->rebuilt.count(month))
+		continue;
+	    for (Xapian::PostingIterator p = w->old.postlist_begin(*t);
+		 p != w->old.postlist_end(*t);
+		 ++p)
+		w->db.add_document(w->old.get_document(*p));
+	    copied = true;
+	    w->db.set_metadata("XH" + month, w->old.get_metadata("XH" + month));
+	    w->db.set_metadata("XC" + month, w->old.get_metadata("XC" + month));
+	    vector<string> keys;
+	    number_keys(w->old, month, keys);
+	    for (size_t k = 0; k < keys.size(); ++k)
+		w->db.set_metadata(keys[k], w->old.get_metadata(keys[k]));
+	}
+	if (copied) {
+	    // The copied documents are indexed as the old shard's were.
+	    carry_mode(w, "XB", body_mode(true));
+	    carry_mode(w, "XQ", quoted_mode_name(QUOTED_INDEX));
+	}
+	w->db.commit();
+    } catch (const Xapian::Error &e) {
+	cerr << "Cannot finish rebuilding " << w->path << ": " << e.get_msg() << endl;
+	return false;
+    }
+    if (! swap_shard(w->path, w->fresh_path)) {
+	cerr << "Cannot swap in rebuilt " << w->path << ": " << strerror(errno) << endl;
+	return false;
+    }
+    if (verbose > 0)
+	cout << "rebuilt " << w->path << endl;
+    w->fresh = false;
+    if (w->state == SHARD_SEALED)
+	queue_compaction(w->path);
+    return true;
+}
+
+// Stop putting new months in w; the months it has can still be updated.
+static void seal(shard_writer * w, size_t shard)
+{
+    if (verbose > 0)
+	cout << "sealing " << w->path << endl;
+    w->db.set_metadata("XS", "sealed");
+    w->db.commit();
+    w->unflushed = 0;
+    w->state = SHARD_SEALED;
+    cat.shards[shard].state = SHARD_SEALED;
+    queue_compaction(w->path);
+}
+
+void xapian_set_shard_limits(unsigned long max_docs, long long max_bytes)
+{
+    shard_max_docs = max_docs;
+    shard_max_bytes = max_bytes;
+}
+
+void xapian_set_body_positions(bool on)
+{
+    body_positions = on;
+}
+
+void xapian_set_quoted(quoted_mode mode)
+{
+    quoted = mode;
+}
+
+void xapian_set_compaction(bool on)
+{
+    if (! on || compaction)
+	return;
+    compaction = true;
+    compact_stopping = false;
+    for (size_t i = 0; i < cat.shards.size(); ++i)
+	if (cat.shards[i].state == SHARD_SEALED)
+	    to_compact.push_back(cat.shards[i].path);
+    if (pthread_create(&compact_thread, NULL, compact_main, NULL) != 0)
+	merror("pthread_create");
+}
+
+void xapian_set_writer_threads(bool on)
+{
+    if (writers.empty())
+	writer_threads = on;
+}
+
+void xapian_set_rebuild(bool on)
+{
+    if (writers.empty())
+	rebuild = on;
+}
+
+void xapian_set_commit_interval(size_t interval)
+{
+    commit_interval = interval;
+}
+
+void xapian_set_lock_wait(int seconds)
+{
+    lock_wait = seconds;
+}
+
+// Stop w's writer thread, if it has one, and close it.
+static void close_writer(shard_writer * w)
+{
+    if (writer_threads) {
+	pthread_mutex_lock(&w->lock);
+	w->stopping = true;
+	pthread_cond_signal(&w->queued);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+    }
+    delete w;
+}
+
+/* Close the writers of the sealed shards, which take no new months, so
+   the compaction thread can get at them while a long run (--serve,
+   --watch) goes on.  A shard still being written to, as the last month
+   to go into it often is for a while, is left open until a flush
+   interval passes without a change, so it isn't compacted over and over.
+   Writing to one of its months after that opens it again.  Everything
+   must have been committed. */
+static void close_sealed(void)
+{
+    vector<shard_writer *> closing;
+    pthread_mutex_lock(&compact_lock);
+    map<string, shard_writer *>::iterator i = writers.begin();
+    while (i != writers.end()) {
+	shard_writer * w = i->second;
+	if (w->state == SHARD_SEALED && ! w->fresh && ! w->touched &&
+	    (current == NULL || current->shard != w)) {
+	    closing.push_back(w);
+	    writers.erase(i++);
+	}
+	else {
+	    w->touched = false;
+	    ++i;
+	}
+    }
+    pthread_cond_broadcast(&compact_cond);
+    pthread_mutex_unlock(&compact_lock);
+    if (closing.empty())
+	return;
+    for (map<string, xapian_month>::iterator m = months.begin(); m != months.end(); ++m)
+	if (find(closing.begin(), closing.end(), m->second.shard) != closing.end())
+	    m->second.shard = NULL;
+    for (size_t j = 0; j < closing.size(); ++j) {
+	if (verbose > 0)
+	    cout << "closing sealed " << closing[j]->path << endl;
+	close_writer(closing[j]);
+    }
+}
 
 void xapian_flush(void)
 {
+    bool rebuilding = false;
     try {
-	db.commit();
+	map<string, shard_writer *>::iterator i;
+	for (i = writers.begin(); i != writers.end(); ++i) {
+	    drain(i->second);
+	    stage_timer timer(STAGE_COMMIT);
+	    i->second->db.commit();
+	    i->second->unflushed = 0;
+	    rebuilding = rebuilding || i->second->fresh;
+	}
+	note_compacted();
+	note_shard_stats();
     } catch (const Xapian::Error &e) {
-	merror(e.get_msg().c_str());
+	failed(e);
+    }
+    if (compaction)
+	close_sealed();
+    // Until xapian_fini() swaps them in, the shards on disk are the old
+    // copies, which the months being rebuilt no longer describe.
+    if (rebuilding)
+	return;
+    if (! catalogue_save(catalogue_path(dbpathprefix), cat))
+	cerr << "Failed to write catalogue: " << strerror(errno) << endl;
+}
+
+void xapian_fini(void)
+{
+    map<string, shard_writer *>::iterator i;
+    for (i = writers.begin(); i != writers.end(); ++i) {
+	shard_writer * w = i->second;
+	if (! w->fresh)
+	    continue;
+	drain(w);
+	if (! publish(w)) {
+	    // Leave the old copy, and a catalogue that gets rebuilt from it.
+	    unlink(catalogue_path(dbpathprefix).c_str());
+	}
+    }
+    xapian_flush();
+    for (i = writers.begin(); i != writers.end(); ++i)
+	close_writer(i->second);
+    pthread_mutex_lock(&compact_lock);
+    writers.clear();
+    pthread_cond_broadcast(&compact_cond);
+    pthread_mutex_unlock(&compact_lock);
+    current = NULL;
+
+    if (compaction) {
+	// Now nothing is open, finish the shards sealed in this run too.
+	pthread_mutex_lock(&compact_lock);
+	compact_stopping = true;
+	pthread_cond_broadcast(&compact_cond);
+	pthread_mutex_unlock(&compact_lock);
+	pthread_join(compact_thread, NULL);
+	compaction = false;
+	note_compacted();
+	if (! catalogue_save(catalogue_path(dbpathprefix), cat))
+	    cerr << "Failed to write catalogue: " << strerror(errno) << endl;
+    }
+    close(series_fd);
+    series_fd = -1;
+}
+
+void xapian_set_throw_errors(bool on)
+{
+    throw_errors = on;
+}
+
+void xapian_abandon(void)
+{
+    map<string, shard_writer *>::iterator i;
+    for (i = writers.begin(); i != writers.end(); ++i)
+	close_writer(i->second);
+    writers.clear();
+    months.clear();
+    current = NULL;
+    cat = catalogue();
+    if (series_fd >= 0)
+	close(series_fd);
+    series_fd = -1;
+}
+
+void xapian_thread_init(void)
+{
+    if (thread_context == NULL)
+	thread_context = new indexing_context;
+}
+
+void xapian_thread_fini(void)
+{
+    if (thread_context != NULL) {
+	delete thread_context->doc;
+	delete thread_context;
+	thread_context = NULL;
     }
 }
 
 void xapian_new_document(void)
 {
-    if (doc != NULL)
-	delete doc;
-	// merror("xapian_new_document called when document is already active");
+    indexing_context & c = ctx();
+    Xapian::Document * & doc = c.doc;
+    // A queued shard op owns the document it was given, so the only ones
+    // reused are those xapian_add_document() writes at once, and one
+    // left from a message which wasn't indexed.
     try {
-	doc = new Xapian::Document();
+	if (doc == NULL) {
+	    doc = new Xapian::Document();
+	} else {
+	    doc->clear_terms();
+	    doc->clear_values();
+	    doc->set_data(string());
+	}
+	// Once per document, so the positions of text indexed in several
+	// goes follow on rather than overlap.
+	c.indexer.set_document(*doc);
     } catch (const Xapian::Error &e) {
-	merror(e.get_msg().c_str());
+	failed(e);
     }
 }
 
 void xapian_tokenise(const char* prefix, const char* text, int len)
 {
+    Xapian::Document * doc = ctx().doc;
+    Xapian::TermGenerator & indexer = ctx().indexer;
     if (doc == NULL) {
 	merror("xapian_tokenise called before xapian_new_document");
     }
+    stage_timer timer(STAGE_TERMGEN);
     try {
-      indexer.set_document(*doc);
 	if (verbose>=2) {
 	    printf("index:[");
 	    fwrite(text, 1, len, stdout);
 	    printf("]\n");
 	}
-        indexer.index_text(text, 1,  prefix ? prefix : "");
+	Xapian::termcount wdf = (quoted == QUOTED_LOW) ? QUOTED_LOW_BOOST : 1;
+	if (body_positions)
+	    indexer.index_text(Xapian::Utf8Iterator(text, len), wdf,  prefix ? prefix : "");
+	else
+	    indexer.index_text_without_positions(Xapian::Utf8Iterator(text, len), wdf,
+						 prefix ? prefix : "");
         
     } catch (const Xapian::Error &e) {
-	merror(e.get_msg().c_str());
+	failed(e);
     }
 }
 
-time_t start_time;
-static time_t last_start_time = 0;
-static int last_total_files = 0;
-static int total_files = 0;
+void xapian_index_field(doc_field field, const char* text, size_t len)
+{
+    indexing_context & c = ctx();
+    const field_spec & spec = field_schema[field];
+    if (c.doc == NULL)
+	merror("xapian_index_field called before xapian_new_document");
+    if (verbose >= 2) {
+	printf("field %s:[", spec.prefix);
+	fwrite(text, 1, len, stdout);
+	printf("]\n");
+    }
+    Xapian::termcount weight = spec.weight;
+    if (quoted == QUOTED_LOW && field != FIELD_QUOTED)
+	weight *= QUOTED_LOW_BOOST;
+    stage_timer timer(STAGE_TERMGEN);
+    try {
+	if (spec.whole) {
+	    c.doc->add_term(c.term.assign(spec.prefix).append(text, len), weight);
+	} else {
+	    Xapian::Utf8Iterator words(text, len);
+	    if (spec.positional)
+		c.indexer.index_text(words, weight, spec.prefix);
+	    else
+		c.indexer.index_text_without_positions(words, weight, spec.prefix);
+	}
+    } catch (const Xapian::Error &e) {
+	failed(e);
+    }
+}
+
+static const string &
+month_term(string & term, const std::string & list, int year, int month)
+{
+    char buf[64];
+    if (month != 0)
+      sprintf(buf, "%04d%02d", year,month);
+    else
+      sprintf(buf, "%04d", year);
+    return term.assign("XM").append(list).append("-").append(buf);
+}
+
+static const string &
+msgid_term(string & term, const std::string & msgid)
+{
+    // Truncate - we verify the full message id before deleting in cases
+    // where it might be truncated.
+    return term.assign("XI").append(msgid, 0, MAX_TERM_LENGTH - 2);
+}
+
+xapian_month * xapian_current_month(void)
+{
+    return current;
+}
 
 void
-xapian_delete_document(std::string & list, int year, int month, int  msgnum) 
+xapian_delete_document(xapian_month * target, const std::string & list, int year, int month, int msgnum, const std::string & msgid)
 {
    char buf[64];
 
    sprintf(buf, "%04d%02d%05d", year,month,msgnum);
-   string ourxapid("Q");
-   ourxapid += list;
-   ourxapid += buf;
-   db.delete_document(ourxapid);
+   shard_op * op = new shard_op;
+   op->kind = shard_op::DELETE;
+   op->month = target;
+   op->term = "Q";
+   op->term += list;
+   op->term += buf;
+   if (! msgid.empty())
+     op->number_key = number_key(target->name, msgid);
+   op->msgnum = msgnum;
+   op->doc = NULL;
+   submit(target->shard, op);
 }
 
 void
-xapian_add_document(const document *d, std::string & msgid, std::string & list, int year, int month, int  msgnum)
+xapian_delete_document(std::string & list, int year, int month, int  msgnum, const std::string & msgid)
+{
+   xapian_delete_document(current, list, year, month, msgnum, msgid);
+}
+
+Xapian::Document *
+xapian_build_document(const document *d, const std::string & msgid, const std::string & list, int year, int month, int msgnum, std::string & ourxapid)
 {
+    indexing_context & c = ctx();
+    Xapian::Document * doc = c.doc;
+    string & term = c.term;
     if (doc == NULL)
-	merror("xapian_add_document called before xapian_new_document");
-    doc->add_boolean_term( string("G")+list);
-    
-    if (!d->email.empty()) {
-	try {
-	    doc->add_term(string("A") + d->email);
-	    if (verbose >= 2) printf("author:[A%s]\n", d->email.c_str());
-	} catch (const Xapian::Error &e) {
-	    merror(e.get_msg().c_str());
-	}
-    }
-    if (!d->author.empty()) {
-	try {
-	   xapian_tokenise("A", d->author.c_str(), d->author.length());
-	    if (verbose >= 2) printf("author:[A%s]\n", d->author.c_str());
-	} catch (const Xapian::Error &e) {
-	    merror(e.get_msg().c_str());
-	}
-    }
-    indexer.index_text(d->subject, 3);
+	merror("xapian_build_document called before xapian_new_document");
+    doc->add_boolean_term(term.assign("G").append(list));
     
+    // The header fields were indexed as they were parsed.
+
     char buf[64];
     sprintf(buf, "%04d%02d%05d", year,month,msgnum);
-    string ourxapid("Q");
+    ourxapid = "Q";
     ourxapid += list;
     ourxapid += buf;
     doc->add_boolean_term(ourxapid);
@@ -124,24 +1005,13 @@ xapian_add_document(const document *d, std::string & msgid, std::string & list,
     // L language
     // XSL language used for stemming
     // Q id
-    if (! language.empty())
-      doc->add_boolean_term(string("L")+language);
-    if (! stemmer_language.empty())
-      doc->add_boolean_term(string("XSL")+stemmer_language);
+    if (! c.language.empty())
+      doc->add_boolean_term(term.assign("L").append(c.language));
+    if (! c.stemmer_language.empty())
+      doc->add_boolean_term(term.assign("XSL").append(c.stemmer_language));
 
-    if (month != 0)
-      sprintf(buf, "%04d%02d", year,month);
-    else
-      sprintf(buf, "%04d", year);      
-    doc->add_boolean_term((string("XM")+list+"-")+buf);
-
-    if (msgid.size() <= MAX_TERM_LENGTH - 2) {
-	doc->add_boolean_term(string("XI") + msgid);
-    } else {
-	// Truncate - we verify the full message id before deleting in cases
-	// where it might be truncated.
-	doc->add_boolean_term(string("XI") + msgid.substr(0, MAX_TERM_LENGTH - 2));
-    }
+    doc->add_boolean_term(month_term(term, list, year, month));
+    doc->add_boolean_term(msgid_term(term, msgid));
 
     struct tm ts;
     memset(&ts, 0, sizeof(ts));
@@ -175,12 +1045,10 @@ xapian_add_document(const document *d, std::string & msgid, std::string & list,
     else 
 	sprintf(buf, "/%04d/msg%05d.html", year, msgnum);
     //      $set{fieldnames,$split{url list msgno year month subject author}}
-    string url("/");
-    url += list;
-    url += buf;
-   
-    string data;
-    data += url;
+    string & data = c.data;
+    data.assign("/");
+    data += list;
+    data += buf;
     data += "\n";
     data += list;
       
@@ -198,93 +1066,336 @@ xapian_add_document(const document *d, std::string & msgid, std::string & list,
 
     if (verbose >= 2) printf("data:[%s]\n\n", data.c_str());
     doc->set_data(data);
-    db.replace_document(ourxapid,*doc);
-    delete doc;
-    doc = NULL;
+    c.doc = NULL;
+    return doc;
+}
 
-    ++total_files;
-    
-    if ((total_files % 10000) == 0) {
-	/* TV-TODO: chunks?
-	 if (total_files % INDEX_CHUNK_SIZE == 0) {
-	    // Move onto next database chunk...
-	    xapian_init();
-	}
-	 */
-	time_t now = time(NULL);
-	time_t elapsed = now - start_time;
-	if (last_start_time == 0) last_start_time = start_time;
-	if (elapsed != 0) {
-	    int last_elapsed = now - last_start_time;
-	    int last_rate = 0;
-	    if (last_elapsed)
-		last_rate = (total_files - last_total_files) / last_elapsed;
-            if (verbose > 0)
-	      printf("    %d files (%d/s; %d/s last %d seconds)\n",
-                     total_files, (int)(total_files/elapsed), last_rate,
-                     last_elapsed);
-	    last_start_time = now;
-	    last_total_files = total_files;
+void
+xapian_write_document(xapian_month * target, const std::string & ourxapid, int msgnum, Xapian::Document * doc)
+{
+    shard_op * op = new shard_op;
+    op->kind = shard_op::REPLACE;
+    op->month = target;
+    op->term = ourxapid;
+    op->msgnum = msgnum;
+    op->doc = doc;
+    submit(target->shard, op);
+}
+
+void
+xapian_add_document(const document *d, std::string & msgid, std::string & list, int year, int month, int  msgnum)
+{
+    string ourxapid;
+    Xapian::Document * doc = xapian_build_document(d, msgid, list, year, month, msgnum, ourxapid);
+    if (writer_threads) {
+	xapian_write_document(current, ourxapid, msgnum, doc);
+	return;
+    }
+    // Written before we return, so the document can be kept for the
+    // next message rather than freed.
+    shard_op * op = new shard_op;
+    op->kind = shard_op::REPLACE;
+    op->month = current;
+    op->term = ourxapid;
+    op->msgnum = msgnum;
+    op->doc = doc;
+    op->keep_doc = true;
+    ctx().doc = doc;
+    apply(current->shard, op);
+}
+
+bool
+xapian_msgid_taken(const std::string & msgid, const std::string & list, int year, int month, int msgnum)
+{
+    string xmterm, xiterm;
+    month_term(xmterm, list, year, month);
+    msgid_term(xiterm, msgid);
+    char buf[64];
+    sprintf(buf, "%04d%02d%05d", year,month,msgnum);
+    string qterm("Q");
+    qterm += list;
+    qterm += buf;
+    drain(current->shard);
+    Xapian::WritableDatabase & db = current->shard->db;
+    try {
+	string taken = db.get_metadata(number_key(current->name, msgid));
+	if (! taken.empty() && atoi(taken.c_str()) != msgnum)
+	    return true;
+	// Usually one posting, a few more for cross-posted messages.
+	for (Xapian::PostingIterator p = db.postlist_begin(xiterm);
+	     p != db.postlist_end(xiterm);
+	     ++p) {
+	    // Q sorts before XM.
+	    Xapian::TermIterator t = db.termlist_begin(*p);
+	    t.skip_to(qterm);
+	    if (t != db.termlist_end(*p) && *t == qterm)
+		continue;
+	    t.skip_to(xmterm);
+	    if (t == db.termlist_end(*p) || *t != xmterm)
+		continue;
+	    // The XI term of a long message-id is cut short, but the
+	    // document data ends with all of it.
+	    if (xiterm.size() - 2 < msgid.size()) {
+		string data = db.get_document(*p).get_data();
+		if (data.size() < msgid.size() ||
+		    data.compare(data.size() - msgid.size(), msgid.size(), msgid) != 0)
+		    continue;
+	    }
+	    return true;
 	}
+    } catch (const Xapian::Error &e) {
+	failed(e);
     }
+    return false;
+}
+
+// Checkpoints are stored as user metadata "XC<list>-<month>" in the shard
+// holding the month, so they are committed together with the documents.
+bool xapian_get_checkpoint(const string month, mbox_checkpoint & cp)
+{
+  string value;
+  drain(current->shard);
+  try {
+    value = current->shard->db.get_metadata(string("XC")+month);
+  } catch (const Xapian::Error &e) {
+    failed(e);
+  }
+  if (value.empty())
+    return false;
+
+  char hash[64];
+  long long spammtime;
+  // The length was added later, so may be missing.
+  cp.length = -1;
+  if (sscanf(value.c_str(), "%lld %d %63s %lld %lld %lld",
+             &cp.offset, &cp.msgnum, hash, &cp.spamsize, &spammtime,
+             &cp.length) < 5)
+    return false;
+  cp.hash = hash;
+  cp.spammtime = spammtime;
+  return true;
 }
 
-map<const string, size_t> monthtodbmap;
-glob_t globbuf;
+void xapian_set_checkpoint(const string month, const mbox_checkpoint & cp)
+{
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%lld %d %s %lld %lld %lld",
+           cp.offset, cp.msgnum, cp.hash.c_str(), cp.spamsize,
+           (long long)cp.spammtime, cp.length);
+  shard_op * op = new shard_op;
+  op->kind = shard_op::SET_METADATA;
+  op->month = current;
+  op->term = string("XC")+month;
+  op->value = buf;
+  op->doc = NULL;
+  submit(current->shard, op);
+}
 
-void init_monthtodbmap()
+void xapian_list_months(vector<string> & months)
 {
-  int res = glob((dbpathprefix+"*").c_str(), 0, NULL, &globbuf);
+  for (map<string, month_info>::iterator i = cat.months.begin(); i != cat.months.end(); ++i)
+    months.push_back(i->first);
+}
+
+static void rebuild_catalogue()
+{
+  glob_t globbuf;
+  cat.shards.clear();
+  cat.months.clear();
+  int res = glob(shard_glob().c_str(), 0, NULL, &globbuf);
   if (res==0) {
     for (size_t i=0; globbuf.gl_pathv[i] != NULL; i++) {
       if (verbose>0)
         cout << globbuf.gl_pathv[i] << ":" << endl;
       Xapian::Database a_db(globbuf.gl_pathv[i]);
+      shard_info s;
+      s.path = globbuf.gl_pathv[i];
+      s.stamp = catalogue_stamp(s.path);
+      s.doccount = a_db.get_doccount();
+      s.lastdocid = a_db.get_lastdocid();
+      s.state = shard_state_from(a_db.get_metadata("XS"));
+      cat.shards.push_back(s);
       const string listPrefix("XM");
       for (Xapian::TermIterator ti = a_db.allterms_begin(listPrefix);
            ti != a_db.allterms_end(listPrefix);
            ti++) {
-        monthtodbmap[(*ti).substr(2)] = i;
+        month_info m;
+        if (! load_high_water(a_db, (*ti).substr(2), m)) {
+          // Not recorded by older versions; walking the Q terms is
+          // left until the month is next indexed.
+          m.doccount = ti.get_termfreq();
+          m.maxmsgnum = MAXMSGNUM_UNKNOWN;
+        }
+        m.shard = i;
+        cat.months[(*ti).substr(2)] = m;
         if (verbose>0)
           cout << "  " << (*ti).substr(2) << endl;
       }
     }
-    //globfree(&globbuf);
+    globfree(&globbuf);
   }
   else if (res!=GLOB_NOMATCH) {
     merror("problem initializing stuff");
   }
 }
 
+// Check the loaded catalogue lists the shards there are, with the counts
+// they have.  Only shards whose files have changed since their counts
+// were recorded are opened to compare them.
+static bool catalogue_valid()
+{
+  glob_t globbuf;
+  int res = glob(shard_glob().c_str(), 0, NULL, &globbuf);
+  if (res==GLOB_NOMATCH)
+    return cat.shards.empty();
+  if (res!=0)
+    return false;
+  bool ok = true;
+  size_t i;
+  for (i=0; globbuf.gl_pathv[i] != NULL; i++) {
+    if (i >= cat.shards.size() || cat.shards[i].path != globbuf.gl_pathv[i]) {
+      ok = false;
+      break;
+    }
+    string stamp = catalogue_stamp(globbuf.gl_pathv[i]);
+    if (! stamp.empty() && stamp == cat.shards[i].stamp)
+      continue;
+    Xapian::Database a_db(globbuf.gl_pathv[i]);
+    if (a_db.get_doccount() != cat.shards[i].doccount ||
+        a_db.get_lastdocid() != cat.shards[i].lastdocid) {
+      ok = false;
+      break;
+    }
+    cat.shards[i].stamp = stamp;
+  }
+  ok = ok && (i == cat.shards.size());
+  globfree(&globbuf);
+  return ok;
+}
+
+static size_t shard_index(const string & path)
+{
+  for (size_t i = 0; i < cat.shards.size(); ++i)
+    if (cat.shards[i].path == path)
+      return i;
+  shard_info s;
+  s.path = path;
+  s.doccount = 0;
+  s.lastdocid = 0;
+  s.state = SHARD_OPEN;
+  cat.shards.push_back(s);
+  return cat.shards.size() - 1;
+}
+
+/* One process at a time writes to a series.  Each loads the catalogue
+   at xapian_init() and saves its own copy over it, so two at once would
+   lose each other's new months, and could put one month in two shards
+   or give two messages the same msgnum.  The lock is an flock() on a
+   file beside the catalogue, waited for as a locked shard is. */
+static void lock_series(void)
+{
+  string path = catalogue_path(dbpathprefix) + ".lock";
+  series_fd = open(path.c_str(), O_RDWR | O_CREAT, 0666);
+  if (series_fd < 0 && throw_errors)
+    throw Xapian::DatabaseOpeningError(path + ": " + strerror(errno));
+  if (series_fd < 0)
+    merror(path.c_str());
+  for (int waited = 0; flock(series_fd, LOCK_EX | LOCK_NB) != 0; waited++) {
+    if (errno != EWOULDBLOCK && throw_errors)
+      throw Xapian::DatabaseOpeningError(path + ": " + strerror(errno));
+    if (errno != EWOULDBLOCK)
+      merror(path.c_str());
+    if (waited >= lock_wait && throw_errors)
+      throw Xapian::DatabaseLockError(path + ": in use by another indexer");
+    if (waited >= lock_wait) {
+      cerr << path << ": in use by another indexer" << endl;
+      exit(EX_TEMPFAIL);
+    }
+    sleep(1);
+  }
+}
+
 void xapian_init(const char* adbpathprefix)
 {
   if (adbpathprefix) {
     dbpathprefix = adbpathprefix;
   }
-  
+  lock_series();
+
   try {
-    init_monthtodbmap();
+    string catpath = catalogue_path(dbpathprefix);
+    if (catalogue_load(catpath, cat) && catalogue_valid()) {
+      if (verbose>0)
+        cout << "using catalogue " << catpath << endl;
+    }
+    else {
+      if (verbose>0)
+        cout << "rebuilding catalogue " << catpath << endl;
+      rebuild_catalogue();
+      if (! catalogue_save(catpath, cat))
+        cerr << "Failed to write catalogue: " << strerror(errno) << endl;
+    }
     xapian_set_stemmer("en");
   } catch (const Xapian::Error &e) {
-    merror(e.get_msg().c_str());
+    failed(e);
   }
 }
 
-static string curdb;
-
 long xapian_open_db_for_month(const string month, const bool deleteallexisting)
 {
-  map<const string, size_t>::iterator i = monthtodbmap.find(month);
+  map<string, month_info>::iterator i = cat.months.find(month);
   int maxmsgnum = -1;
-  if (i != monthtodbmap.end()) {
-    if (curdb != globbuf.gl_pathv[i->second]) {
-      curdb = globbuf.gl_pathv[i->second];
-      db = Xapian::WritableDatabase(curdb, Xapian::DB_CREATE_OR_OPEN);
-    }    
-    if (! deleteallexisting) {
+  shard_writer * w;
+  if (i != cat.months.end()) {
+    w = get_writer(cat.shards[i->second.shard].path);
+  }
+  else {
+    // A new month goes in the first shard not yet sealed, sealing that
+    // if it has filled up.
+    size_t shard;
+    while (true) {
+      string dbpath(dbpathprefix);
+      char buf[256];
+      sprintf(buf, "-%03d", counter);
+      dbpath += buf;
+      shard = shard_index(dbpath);
+      if (cat.shards[shard].state == SHARD_OPEN) {
+        w = get_writer(dbpath);
+        drain(w);
+        if (w->state == SHARD_OPEN && ! shard_full(w))
+          break;
+        if (w->state == SHARD_OPEN)
+          seal(w, shard);
+      }
+      counter++;
+    }
+    month_info m;
+    m.shard = shard;
+    m.doccount = 0;
+    m.maxmsgnum = -1;
+    i = cat.months.insert(make_pair(month, m)).first;
+  }
+
+  xapian_month & xm = months[month];
+  xm.name = month;
+  xm.info = &i->second;
+  xm.shard = w;
+  if (w->fresh)
+    w->rebuilt.insert(month);
+  current = &xm;
+  // Anything still queued for this month must land before we look.
+  drain(w);
+  Xapian::WritableDatabase & db = w->db;
+
+  if (! deleteallexisting) {
+    // The shard, now we hold it, has the last word over the catalogue.
+    if (load_high_water(db, month, i->second)) {
+      maxmsgnum = i->second.maxmsgnum;
+    }
+    else if (i->second.maxmsgnum == MAXMSGNUM_UNKNOWN) {
       // get last message indexed, stupid duplication...
-      int i = month.find_last_of('-');
-      string prefix(string("Q")+month.substr(0,i)+month.substr(i+1));
+      int dash = month.find_last_of('-');
+      string prefix(string("Q")+month.substr(0,dash)+month.substr(dash+1));
 
       if (verbose>=2)
         cout << "looking for documents beginning with " << prefix << endl;
@@ -296,51 +1407,53 @@ long xapian_open_db_for_month(const string month, const bool deleteallexisting)
         if (msgnum>maxmsgnum)
           maxmsgnum = msgnum;
       }
-      if (verbose>=2)
-        cout << "have indexed " << month <<  " up to " << maxmsgnum << endl;
+      i->second.maxmsgnum = maxmsgnum;
+      i->second.doccount = db.get_termfreq(string("XM")+month);
+      store_high_water(current);
     }
     else {
-      if (verbose > 0)
-        cout << "deleting documents from " << month << endl;
-      db.delete_document(string("XM")+month);
+      maxmsgnum = i->second.maxmsgnum;
     }
-    total_files = db.get_doccount();
+    if (verbose>=2)
+      cout << "have indexed " << month <<  " up to " << maxmsgnum << endl;
   }
   else {
-    total_files = -1;
-    while ((total_files < 0) or (total_files > INDEX_CHUNK_SIZE)) {
-      string dbpath(dbpathprefix);
-      char buf[256];
-      sprintf(buf, "-%03d", counter);
-      dbpath += buf;
-      if (curdb != dbpath) {
-        curdb = dbpath;
-        db = Xapian::WritableDatabase(dbpath, Xapian::DB_CREATE_OR_OPEN);
-      }
-      total_files = db.get_doccount();
-      if (total_files > INDEX_CHUNK_SIZE)
-        counter++;
-    }
+    if (verbose > 0)
+      cout << "deleting documents from " << month << endl;
+    db.delete_document(string("XM")+month);
+    vector<string> keys;
+    number_keys(db, month, keys);
+    for (size_t k = 0; k < keys.size(); ++k)
+      db.set_metadata(keys[k], "");
+    i->second.doccount = 0;
+    i->second.maxmsgnum = -1;
+    store_high_water(current);
   }
   return maxmsgnum;
 }
 
+string xapian_get_language(void)
+{
+  return ctx().language;
+}
+
 void xapian_set_stemmer(const string lang)
 {
-  if (lang == language) {
+  indexing_context & c = ctx();
+  if (lang == c.language) {
     return;    
   }
   
   try {
-    language = lang;
+    c.language = lang;
     try {
-      indexer.set_stemmer(Xapian::Stem(lang));
-      stemmer_language = lang;
+      c.indexer.set_stemmer(Xapian::Stem(lang));
+      c.stemmer_language = lang;
     } catch (const Xapian::InvalidArgumentError &e) {
-      indexer.set_stemmer(Xapian::Stem());
-      stemmer_language.erase();
+      c.indexer.set_stemmer(Xapian::Stem());
+      c.stemmer_language.erase();
     }
   } catch (const Xapian::Error &e) {
-    merror(e.get_msg().c_str());
+    failed(e);
   }
 }
@@ -1,20 +1,132 @@
 
+/* Default number of documents at which a shard is sealed. */
+#define INDEX_CHUNK_SIZE 1000000
+
 enum value_slot {
   VALUE_DATECODE = 0
 };
 
+/* The header fields of a message, and its quoted text when that is
+   indexed apart from the rest of the body.  Each is indexed in one pass,
+   as its field_schema entry says; the header fields are kept in the
+   document data up to max_length bytes (0 for no limit). */
+enum doc_field {
+  FIELD_SUBJECT = 0,
+  FIELD_AUTHOR,
+  FIELD_EMAIL,
+  FIELD_QUOTED,
+  FIELD_COUNT
+};
+
+struct field_spec {
+  const char *prefix;		/* term prefix */
+  unsigned weight;		/* wdf added for each occurrence */
+  bool positional;		/* with positions, for phrase searches */
+  bool whole;			/* the whole value as one term, not words */
+  size_t max_length;		/* of the value kept in the document data */
+};
+
+extern const field_spec field_schema[FIELD_COUNT];
+
+/* Open the series of shards dbpathprefix-NNN, which no other process
+   may write to until xapian_fini(): one already doing so is waited for
+   as a locked shard is. */
 extern void xapian_init(const char* dbpathprefix);
 extern void xapian_flush(void);
+/* Flush, then close every shard. */
+extern void xapian_fini(void);
+/* Throw Xapian errors to the caller rather than aborting, and for a
+   series or shard locked too long a Xapian::DatabaseLockError rather than
+   exiting.  Not for use with writer threads, whose errors still abort.
+   After one is thrown, the caller is to call xapian_abandon(). */
+extern void xapian_set_throw_errors(bool on);
+/* Close every shard and let go of the series without saving the
+   catalogue, which the next xapian_init() then checks against the
+   shards.  What was written since the last flush may or may not have
+   been committed. */
+extern void xapian_abandon(void);
+/* Apply each shard's changes in a thread of its own.  Only takes effect
+   before the first shard is opened. */
+extern void xapian_set_writer_threads(bool on);
+/* Index into a new copy of each existing shard with add_document(), and
+   swap the copies in at xapian_fini(), with the months not indexed in this
+   run carried over.  Only takes effect before the first shard is opened. */
+extern void xapian_set_rebuild(bool on);
+/* Commit a shard by itself once this many documents are pending on it;
+   0 leaves commits to xapian_flush(). */
+extern void xapian_set_commit_interval(size_t interval);
+/* Wait up to this many seconds for a series or shard another process is
+   writing to, then exit with EX_TEMPFAIL; 0, the default, exits at
+   once.  Set it before xapian_init(). */
+extern void xapian_set_lock_wait(int seconds);
+/* A shard is sealed, taking no new months, once it holds max_docs
+   documents or max_bytes bytes on disk; 0 means no limit. */
+extern void xapian_set_shard_limits(unsigned long max_docs, long long max_bytes);
+/* Compact sealed shards in a background thread; xapian_fini() waits for
+   it to finish. */
+extern void xapian_set_compaction(bool on);
+/* Index body text without positions, so phrase searches only work on
+   the subject and author but the shards are much smaller.  Each shard's
+   "XB" metadata says how its bodies are indexed: "positions", "none" or
+   "mixed". */
+extern void xapian_set_body_positions(bool on);
+/* How quoted text is indexed, as tokenizer_set_quoted() says; with
+   QUOTED_LOW the rest of each message is indexed at a higher wdf.  Each
+   shard's "XQ" metadata records the mode: "index", "skip", "low" or
+   "mixed". */
+extern void xapian_set_quoted(quoted_mode mode);
 extern void xapian_new_document(void);
 extern void xapian_tokenise(const char* prefix, const char* text, int len);
+extern void xapian_index_field(doc_field field, const char* text, size_t len);
+/* Give the calling thread its own document, TermGenerator and stemmer. */
+extern void xapian_thread_init(void);
+extern void xapian_thread_fini(void);
 
 extern const char *index_dir;
 extern time_t start_time;
 
 #include <string>
+#include <vector>
+
+/* Where the previous run stopped in an mbox, so that the next run can
+   seek past the part that has already been indexed. */
+struct mbox_checkpoint {
+  long long offset;     /* offset of the From_ line of the last message */
+  int msgnum;           /* msgnum of that message */
+  std::string hash;     /* mbox_prefix_hash() at offset */
+  long long spamsize;   /* size and mtime of the .spam file, as spam */
+  time_t spammtime;     /* messages before offset need deleting too */
+  long long length;     /* of that message, to tell if it was still being
+			   written; -1 if not recorded */
+};
+
+namespace Xapian { class Document; }
+
+/* A month being indexed, and the shard it is written to. */
+struct xapian_month;
+/* The month last opened by xapian_open_db_for_month(). */
+xapian_month * xapian_current_month(void);
 
+/* Index d in the month opened last.  Without writer threads it is written
+   at once, and the calling thread's document is kept for the next. */
 void xapian_add_document(const document *d, std::string & msgid, std::string & list, int year, int month, int msgnum);
-void xapian_delete_document(std::string & list, int year, int month, int  msgnum);
+/* xapian_add_document() in two halves: building the document only touches
+   the calling thread's indexing state, writing it queues it for target's
+   shard, which takes ownership of doc. */
+Xapian::Document * xapian_build_document(const document *d, const std::string & msgid, const std::string & list, int year, int month, int msgnum, std::string & ourxapid);
+void xapian_write_document(xapian_month * target, const std::string & ourxapid, int msgnum, Xapian::Document * doc);
+/* Delete what is at msgnum, which msgid, if not empty, still takes: the
+   month's high-water moves past it, and xapian_msgid_taken() knows it. */
+void xapian_delete_document(std::string & list, int year, int month, int  msgnum, const std::string & msgid);
+void xapian_delete_document(xapian_month * target, const std::string & list, int year, int month, int msgnum, const std::string & msgid);
 void xapian_delete_msgid(std::string & msgid);
+/* Whether msgid took a msgnum other than msgnum in the month opened
+   last, indexed or as a deleted message. */
+bool xapian_msgid_taken(const std::string & msgid, const std::string & list, int year, int month, int msgnum);
+bool xapian_get_checkpoint(const std::string month, mbox_checkpoint & cp);
+void xapian_set_checkpoint(const std::string month, const mbox_checkpoint & cp);
 void xapian_set_stemmer(const std::string lang);
+std::string xapian_get_language(void);
 long xapian_open_db_for_month(const std::string month, const bool deleteallexisting);
+/* Append the months that have a shard in the database to months. */
+void xapian_list_months(std::vector<std::string> & months);